@@ -20,6 +20,12 @@
 #endif
 #include <llvm/Support/Path.h>
 
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
 using namespace clang;
 
 namespace ccls {
@@ -98,24 +104,11 @@ Range fromTokenRangeDefaulted(const SourceManager &sm, const LangOptions &lang,
   return range;
 }
 
-std::unique_ptr<CompilerInvocation>
-buildCompilerInvocation(const std::string &main, std::vector<const char *> args,
-                        IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs) {
-  std::string save = "-resource-dir=" + g_config->clang.resourceDir;
-  args.push_back(save.c_str());
-  args.push_back("-fsyntax-only");
-
-  // Similar to clang/tools/driver/driver.cpp:insertTargetAndModeArgs but don't
-  // require llvm::InitializeAllTargetInfos().
-  auto target_and_mode =
-      driver::ToolChain::getTargetAndModeFromProgramName(args[0]);
-  if (target_and_mode.DriverMode)
-    args.insert(args.begin() + 1, target_and_mode.DriverMode);
-  if (!target_and_mode.TargetPrefix.empty()) {
-    const char *arr[] = {"-target", target_and_mode.TargetPrefix.c_str()};
-    args.insert(args.begin() + 1, std::begin(arr), std::end(arr));
-  }
-
+namespace {
+// Runs the driver and returns the arguments of the cc1 job in |cc1|.
+bool runDriver(const std::vector<const char *> &args,
+               IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs,
+               std::vector<std::string> &cc1) {
   IntrusiveRefCntPtr<DiagnosticsEngine> diags(
       CompilerInstance::createDiagnostics(new DiagnosticOptions,
                                           new IgnoringDiagConsumer, true));
@@ -131,7 +124,7 @@ buildCompilerInvocation(const std::string &main, std::vector<const char *> args,
 #endif
   std::unique_ptr<driver::Compilation> comp(d.BuildCompilation(args));
   if (!comp)
-    return nullptr;
+    return false;
   const driver::JobList &jobs = comp->getJobs();
   bool offload_compilation = false;
   if (jobs.size() > 1) {
@@ -145,15 +138,180 @@ buildCompilerInvocation(const std::string &main, std::vector<const char *> args,
       }
     }
     if (!offload_compilation)
-      return nullptr;
+      return false;
   }
   if (jobs.size() == 0 || !isa<driver::Command>(*jobs.begin()))
-    return nullptr;
+    return false;
 
   const driver::Command &cmd = cast<driver::Command>(*jobs.begin());
   if (StringRef(cmd.getCreator().getName()) != "clang")
-    return nullptr;
+    return false;
   const llvm::opt::ArgStringList &cc_args = cmd.getArguments();
+  cc1.assign(cc_args.begin(), cc_args.end());
+  return true;
+}
+
+// Placeholders for the main file, the output file, the output file without
+// its extension and the basename of the main file.
+const char kMainArg = '\1', kOutputArg = '\2', kOutputStemArg = '\3',
+           kBaseArg = '\4';
+
+// Replaces occurrences of the strings in |subs| (the longest match first) with
+// their placeholders.
+std::string abstractArg(StringRef arg,
+                        const std::vector<std::pair<StringRef, char>> &subs) {
+  std::string ret;
+  for (size_t i = 0; i < arg.size();) {
+    auto it = std::find_if(subs.begin(), subs.end(), [&](auto &sub) {
+      return arg.substr(i).startswith(sub.first);
+    });
+    if (it == subs.end()) {
+      ret += arg[i++];
+    } else {
+      ret += it->second;
+      i += it->first.size();
+    }
+  }
+  return ret;
+}
+
+// Driver outputs keyed by the driver arguments with the main file (but not its
+// extension) and the output file abstracted out. Files with the same flags
+// share an entry, so the driver runs once per flag set. nullopt records a
+// failure. The least recently used entries are evicted first.
+struct DriverEntry {
+  std::string key;
+  std::optional<std::vector<std::string>> cc1;
+};
+std::mutex driver_cache_mutex;
+std::list<DriverEntry> driver_entries;
+std::unordered_map<std::string_view, std::list<DriverEntry>::iterator>
+    driver_cache;
+
+bool getCC1Args(const std::string &main, const std::vector<const char *> &args,
+                IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs,
+                std::vector<std::string> &cc1) {
+  StringRef input, output;
+  std::string key;
+  for (size_t i = 0; i < args.size(); i++) {
+    StringRef arg = args[i];
+    if (i && StringRef(args[i - 1]) == "-o") {
+      output = arg;
+      key += kOutputArg;
+    } else if (i && input.empty() && arg.size() && arg[0] != '-' &&
+               (arg == main || llvm::sys::path::filename(arg) ==
+                                   llvm::sys::path::filename(main))) {
+      input = arg;
+      (key += kMainArg) += llvm::sys::path::extension(arg);
+    } else {
+      key += arg;
+    }
+    key += '\0';
+  }
+  if (input.empty())
+    return runDriver(args, vfs, cc1);
+  StringRef base = llvm::sys::path::filename(input),
+            output_stem = output.drop_back(
+                llvm::sys::path::extension(output).size());
+  {
+    std::lock_guard lock(driver_cache_mutex);
+    auto it = driver_cache.find(key);
+    if (it != driver_cache.end()) {
+      driver_entries.splice(driver_entries.begin(), driver_entries,
+                            it->second);
+      if (!it->second->cc1)
+        return false;
+      cc1.clear();
+      for (const std::string &arg : *it->second->cc1) {
+        std::string &out = cc1.emplace_back();
+        for (char c : arg)
+          switch (c) {
+          case kMainArg:
+            out += input;
+            break;
+          case kOutputArg:
+            out += output;
+            break;
+          case kOutputStemArg:
+            out += output_stem;
+            break;
+          case kBaseArg:
+            out += base;
+            break;
+          default:
+            out += c;
+          }
+      }
+      return true;
+    }
+  }
+
+  bool ok = runDriver(args, vfs, cc1);
+  std::optional<std::vector<std::string>> entry;
+  if (ok) {
+    // Derived names such as -main-file-name, -dependency-file or
+    // -coverage-notes-file embed the main or output file.
+    std::vector<std::pair<StringRef, char>> subs{{input, kMainArg},
+                                                 {base, kBaseArg}};
+    // A stem without a directory, e.g. "a" of "-o a.o", may occur by
+    // coincidence, so it is not substituted and such outputs are not cached.
+    bool stem_safe = llvm::sys::path::has_parent_path(output_stem);
+    if (output.size()) {
+      subs.emplace_back(output, kOutputArg);
+      if (output_stem.size() < output.size() && stem_safe)
+        subs.emplace_back(output_stem, kOutputStemArg);
+    }
+    std::stable_sort(subs.begin(), subs.end(), [](auto &l, auto &r) {
+      return l.first.size() > r.first.size();
+    });
+    entry.emplace();
+    for (const std::string &arg : cc1) {
+      entry->push_back(abstractArg(arg, subs));
+      if (!stem_safe && output_stem.size() &&
+          StringRef(entry->back()).find(output_stem) != StringRef::npos)
+        return true;
+    }
+  }
+  std::lock_guard lock(driver_cache_mutex);
+  if (driver_cache.count(key))
+    return ok;
+  if (driver_entries.size() >= 4096) {
+    driver_cache.erase(driver_entries.back().key);
+    driver_entries.pop_back();
+  }
+  driver_entries.push_front({std::move(key), std::move(entry)});
+  driver_cache.emplace(driver_entries.front().key, driver_entries.begin());
+  return ok;
+}
+} // namespace
+
+std::unique_ptr<CompilerInvocation>
+buildCompilerInvocation(const std::string &main, std::vector<const char *> args,
+                        IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs) {
+  std::string save = "-resource-dir=" + g_config->clang.resourceDir;
+  args.push_back(save.c_str());
+  args.push_back("-fsyntax-only");
+
+  // Similar to clang/tools/driver/driver.cpp:insertTargetAndModeArgs but don't
+  // require llvm::InitializeAllTargetInfos().
+  auto target_and_mode =
+      driver::ToolChain::getTargetAndModeFromProgramName(args[0]);
+  if (target_and_mode.DriverMode)
+    args.insert(args.begin() + 1, target_and_mode.DriverMode);
+  if (!target_and_mode.TargetPrefix.empty()) {
+    const char *arr[] = {"-target", target_and_mode.TargetPrefix.c_str()};
+    args.insert(args.begin() + 1, std::begin(arr), std::end(arr));
+  }
+
+  std::vector<std::string> cc1;
+  if (!getCC1Args(main, args, vfs, cc1))
+    return nullptr;
+  std::vector<const char *> cc_args;
+  for (const std::string &arg : cc1)
+    cc_args.push_back(arg.c_str());
+  IntrusiveRefCntPtr<DiagnosticsEngine> diags(
+      CompilerInstance::createDiagnostics(new DiagnosticOptions,
+                                          new IgnoringDiagConsumer, true));
   auto ci = std::make_unique<CompilerInvocation>();
 #if LLVM_VERSION_MAJOR >= 10 // rC370122
   if (!CompilerInvocation::CreateFromArgs(*ci, cc_args, *diags))
@@ -54,6 +54,22 @@ struct Config {
     // conflicting cache files for system headers.
     bool hierarchicalPath = false;
 
+    // Arguments matching any of these glob patterns do not invalidate cache
+    // files when they change, e.g. when the build system regenerates
+    // compile_commands.json with different warning or debug flags. They are
+    // still passed to clang. An ignored -o ignores its value as well.
+    std::vector<std::string> ignoreArgs{"-o",
+                                        "-W[!p]*",
+                                        "-g",
+                                        "-g[0-9]",
+                                        "-gdwarf*",
+                                        "-ggdb*",
+                                        "-gline-*",
+                                        "-gsplit-dwarf",
+                                        "-fcolor-diagnostics",
+                                        "-fno-color-diagnostics",
+                                        "-fdiagnostics-color*"};
+
     // After this number of loads, keep a copy of file index in memory (which
     // increases memory usage). During incremental updates, the index subtracted
     // will come from the in-memory copy, instead of the on-disk file.
@@ -62,6 +78,13 @@ struct Config {
     // 0: never retain; 1: retain after initial load; 2: retain after 2 loads
     // (initial load+first save)
     int retainInMemory = 2;
+
+    // If true and directory is not empty, build precompiled preambles into
+    // $directory/@preamble/ instead of memory. They are reused across restarts
+    // and sessions as long as the compiler arguments, the preamble text and
+    // the files read while building it are unchanged. A file is removed when
+    // its preamble is replaced, and stale files are swept at startup.
+    bool preamble = false;
   } cache;
 
   struct ServerCap {
@@ -130,6 +153,11 @@ struct Config {
   } codeLens;
 
   struct Completion {
+    // Number of completion results to cache. A cached result is reused and
+    // refiltered as long as the text before the completion position and the
+    // preamble are unchanged.
+    int cacheSize = 8;
+
     // 0: case-insensitive
     // 1: case-folded, i.e. insensitive if no input character is uppercase.
     // 2: case-sensitive
@@ -224,12 +252,17 @@ struct Config {
 
   // Semantic highlighting
   struct Highlight {
-    // Disable semantic highlighting for files larger than the size.
+    // Don't publish semantic highlighting for files larger than the size.
+    // $ccls/semanticHighlight can still be used to request ranges of them.
     int64_t largeFileSize = 2 * 1024 * 1024;
 
     // true: LSP line/character; false: position
     bool lsRanges = false;
 
+    // If true, republish only the symbols whose ranges changed, together with
+    // the removed ones, via $ccls/publishSemanticHighlightDelta.
+    bool delta = false;
+
     // Like index.{whitelist,blacklist}, don't publish semantic highlighting to
     // blacklisted files.
     std::vector<std::string> blacklist;
@@ -301,10 +334,40 @@ struct Config {
     // If the document of a request has not been indexed, wait up to this many
     // milleseconds before reporting error.
     int64_t timeout = 5000;
+
+    // If a queued textDocument/hover, documentHighlight, codeLens or
+    // documentSymbol request is followed by another one of the same method
+    // for the same document, reply to the older one with an empty result
+    // without computing it. Requests whose parameters other than the position
+    // differ, e.g. documentSymbol with different startLine, are all kept.
+    bool supersede = true;
   } request;
 
   struct Session {
+    // Number of threads for code completion, diagnostics and preamble builds,
+    // respectively. Jobs of the same kind on a file are run one at a time;
+    // completion and diagnostics do not wait for a preamble build.
+    int completionThreads = 2;
+    int diagnosticThreads = 2;
+    int preambleThreads = 2;
+
+    // Maximum number of sessions, each of which holds the preamble of an open
+    // file.
     int maxNum = 10;
+
+    // If positive, the least recently used sessions are also evicted when the
+    // total size of their preambles exceeds this number of MiB. Only the
+    // preambles (each shared one counted once) and their stat caches are
+    // counted, not the ASTs built for diagnostics or completion. With
+    // cache.preamble, preambles are stored on disk and barely count, and an
+    // evicted session reloads its preamble from there.
+    int memoryBudget = 0;
+
+    // If true, sessions with identical compiler arguments (ignoring the main
+    // file and -o) and identical preamble text share one preamble, saving
+    // build time and memory. Source locations in the shared preamble refer to
+    // the file it was built for.
+    bool sharePreamble = false;
   } session;
 
   struct WorkspaceSymbol {
@@ -320,10 +383,15 @@ struct Config {
   struct Xref {
     // Maximum number of definition/reference/... results.
     int maxNum = 2000;
+
+    // If true, textDocument/references visits the current file, then other
+    // open files, before the rest of the project. Combined with maxNum, the
+    // results closest to the user are kept.
+    bool nearestFirst = false;
   } xref;
 };
-REFLECT_STRUCT(Config::Cache, directory, format, hierarchicalPath,
-               retainInMemory);
+REFLECT_STRUCT(Config::Cache, directory, format, hierarchicalPath, ignoreArgs,
+               preamble, retainInMemory);
 REFLECT_STRUCT(Config::ServerCap::DocumentOnTypeFormattingOptions,
                firstTriggerCharacter, moreTriggerCharacter);
 REFLECT_STRUCT(Config::ServerCap::Workspace::WorkspaceFolders, supported,
@@ -338,22 +406,24 @@ REFLECT_STRUCT(Config::ClientCapability, diagnosticsRelatedInformation,
 REFLECT_STRUCT(Config::CodeLens, localVariables);
 REFLECT_STRUCT(Config::Completion::Include, blacklist, maxPathSize,
                suffixWhitelist, whitelist);
-REFLECT_STRUCT(Config::Completion, caseSensitivity, detailedLabel,
+REFLECT_STRUCT(Config::Completion, cacheSize, caseSensitivity, detailedLabel,
                dropOldRequests, duplicateOptional, filterAndSort, include,
                maxNum, placeholder);
 REFLECT_STRUCT(Config::Diagnostics, blacklist, onChange, onOpen, onSave,
                spellChecking, whitelist)
-REFLECT_STRUCT(Config::Highlight, largeFileSize, lsRanges, blacklist, whitelist)
+REFLECT_STRUCT(Config::Highlight, largeFileSize, lsRanges, delta, blacklist,
+               whitelist)
 REFLECT_STRUCT(Config::Index::Name, suppressUnwrittenScope);
 REFLECT_STRUCT(Config::Index, blacklist, comments, initialNoLinkage,
                initialBlacklist, initialWhitelist, maxInitializerLines,
                multiVersion, multiVersionBlacklist, multiVersionWhitelist, name,
                onChange, parametersInDeclarations, threads, trackDependency,
                whitelist);
-REFLECT_STRUCT(Config::Request, timeout);
-REFLECT_STRUCT(Config::Session, maxNum);
+REFLECT_STRUCT(Config::Request, timeout, supersede);
+REFLECT_STRUCT(Config::Session, completionThreads, diagnosticThreads, maxNum,
+               memoryBudget, preambleThreads, sharePreamble);
 REFLECT_STRUCT(Config::WorkspaceSymbol, caseSensitivity, maxNum, sort);
-REFLECT_STRUCT(Config::Xref, maxNum);
+REFLECT_STRUCT(Config::Xref, maxNum, nearestFirst);
 REFLECT_STRUCT(Config, compilationDatabaseCommand, compilationDatabaseDirectory,
                cache, capabilities, clang, client, codeLens, completion,
                diagnostics, highlight, index, request, session, workspaceSymbol,
@@ -1238,7 +1238,7 @@ public:
 } // namespace
 
 const int IndexFile::kMajorVersion = 21;
-const int IndexFile::kMinorVersion = 0;
+const int IndexFile::kMinorVersion = 1;
 
 IndexFile::IndexFile(const std::string &path, const std::string &contents,
                      bool no_linkage)
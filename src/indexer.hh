@@ -284,6 +284,8 @@ struct IndexFile {
 
   std::string path;
   std::vector<const char *> args;
+  // argsFingerprint(args, import_file).
+  uint64_t args_hash = 0;
   // This is unfortunately time_t as used by clang::FileEntry
   int64_t mtime = 0;
   LanguageId language = LanguageId::C;
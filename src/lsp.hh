@@ -21,6 +21,9 @@ struct RequestId {
   Type type = kNone;
 
   std::string value;
+  // The connection the request came from, which the reply is routed to. Only
+  // nonzero in daemon mode.
+  int client = 0;
 
   bool valid() const { return type != kNone; }
 };
@@ -34,6 +37,7 @@ struct InMessage {
   std::unique_ptr<rapidjson::Document> document;
   std::chrono::steady_clock::time_point deadline;
   std::string backlog_path;
+  int client = 0;
 };
 
 enum class ErrorCode {
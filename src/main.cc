@@ -45,6 +45,10 @@ opt<std::string> opt_test_index("test-index", ValueOptional, init("!"),
 opt<std::string> opt_index("index",
                            desc("standalone mode: index a project and exit"),
                            value_desc("root"), cat(C));
+opt<std::string> opt_listen(
+    "listen",
+    desc("daemon mode: serve LSP clients connecting to a Unix domain socket"),
+    value_desc("path"), cat(C));
 list<std::string> opt_init("init", desc("extra initialization options in JSON"),
                            cat(C));
 opt<std::string> opt_log_file("log-file", desc("stderr or log file"),
@@ -136,9 +140,16 @@ int main(int argc, char **argv) {
       sys::fs::make_absolute(root);
       pipeline::standalone(std::string(root.data(), root.size()));
     } else {
-      // The thread that reads from stdin and dispatchs commands to the main
-      // thread.
-      pipeline::launchStdin();
+      if (opt_listen.size()) {
+        // Clients share one DB, project and indexer pool. Each connection has
+        // its own reader thread and replies are routed by the stdout thread.
+        if (!pipeline::launchServer(opt_listen))
+          return 1;
+      } else {
+        // The thread that reads from stdin and dispatchs commands to the main
+        // thread.
+        pipeline::launchStdin();
+      }
       // The thread that writes responses from the main thread to stdout.
       pipeline::launchStdout();
       // Main thread which also spawns indexer threads upon the "initialize"
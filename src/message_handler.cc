@@ -48,7 +48,7 @@ REFLECT_STRUCT(DidChangeWatchedFilesParam::Event, uri, type);
 REFLECT_STRUCT(DidChangeWatchedFilesParam, changes);
 REFLECT_STRUCT(DidChangeWorkspaceFoldersParam::Event, added, removed);
 REFLECT_STRUCT(DidChangeWorkspaceFoldersParam, event);
-REFLECT_STRUCT(WorkspaceSymbolParam, query, folders);
+REFLECT_STRUCT(WorkspaceSymbolParam, query, partialResultToken, folders);
 
 namespace {
 struct CclsSemanticHighlightSymbol {
@@ -60,15 +60,42 @@ struct CclsSemanticHighlightSymbol {
 
   // `lsRanges` is used to compute `ranges`.
   std::vector<lsRange> lsRanges;
+
+  std::pair<int, SymbolKind> key() const { return {id, kind}; }
+  bool operator==(const CclsSemanticHighlightSymbol &o) const {
+    return id == o.id && parentKind == o.parentKind && kind == o.kind &&
+           storage == o.storage && ranges == o.ranges && lsRanges == o.lsRanges;
+  }
 };
 
 struct CclsSemanticHighlight {
   DocumentUri uri;
   std::vector<CclsSemanticHighlightSymbol> symbols;
 };
+// Sent instead of CclsSemanticHighlight if highlight.delta is true and the
+// file has been published before.
+struct CclsSemanticHighlightDelta {
+  DocumentUri uri;
+  // New symbols and symbols whose ranges changed, replacing the old ones.
+  std::vector<CclsSemanticHighlightSymbol> symbols;
+  // (id, kind) of symbols that are no longer highlighted.
+  std::vector<std::pair<int, SymbolKind>> removed;
+};
 REFLECT_STRUCT(CclsSemanticHighlightSymbol, id, parentKind, kind, storage,
                ranges, lsRanges);
 REFLECT_STRUCT(CclsSemanticHighlight, uri, symbols);
+REFLECT_STRUCT(CclsSemanticHighlightDelta, uri, symbols, removed);
+
+// The last published semantic highlight of an open file. Only accessed by the
+// main thread. In daemon mode, the highlight is broadcast so that every client
+// has seen the state the next delta is relative to.
+struct HighlightCache {
+  int64_t refcnt_gen;
+  int version;
+  // Sorted by key().
+  std::vector<CclsSemanticHighlightSymbol> symbols;
+};
+llvm::StringMap<HighlightCache> highlight_cache;
 
 struct CclsSetSkippedRanges {
   DocumentUri uri;
@@ -162,6 +189,7 @@ MessageHandler::MessageHandler() {
   bind("$ccls/member", &MessageHandler::ccls_member);
   bind("$ccls/navigate", &MessageHandler::ccls_navigate);
   bind("$ccls/reload", &MessageHandler::ccls_reload);
+  bind("$ccls/semanticHighlight", &MessageHandler::ccls_semanticHighlight);
   bind("$ccls/vars", &MessageHandler::ccls_vars);
   bind("callHierarchy/incomingCalls", &MessageHandler::callHierarchy_incomingCalls);
   bind("callHierarchy/outgoingCalls", &MessageHandler::callHierarchy_outgoingCalls);
@@ -205,6 +233,7 @@ void MessageHandler::run(InMessage &msg) {
   rapidjson::Value null;
   auto it = doc.FindMember("params");
   JsonReader reader(it != doc.MemberEnd() ? &it->value : &null);
+  cur_id = msg.id;
   if (msg.id.valid()) {
     ReplyOnce reply{*this, msg.id};
     auto it = method2request.find(msg.method);
@@ -217,6 +246,8 @@ void MessageHandler::run(InMessage &msg) {
                         ex.what() + " for " + reader.getPath());
       } catch (NotIndexed &) {
         throw;
+      } catch (Cancelled &) {
+        reply.error(ErrorCode::RequestCancelled, "cancelled " + msg.method);
       } catch (...) {
         reply.error(ErrorCode::InternalError,
                     "failed to process " + msg.method);
@@ -281,18 +312,19 @@ void emitSkippedRanges(WorkingFile *wfile, QueryFile &file) {
   pipeline::notify("$ccls/publishSkippedRanges", params);
 }
 
-void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file) {
-  static GroupMatch match(g_config->highlight.whitelist,
-                          g_config->highlight.blacklist);
-  assert(file.def);
-  if (wfile->buffer_content.size() > g_config->highlight.largeFileSize ||
-      !match.matches(file.def->path))
-    return;
-
+namespace {
+// Computes the semantic highlight of |wfile|. If |lines| is specified, only
+// symbols starting in the index lines [lines->first, lines->second) are
+// considered.
+CclsSemanticHighlight
+computeSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file,
+                         std::optional<std::pair<int, int>> lines) {
   // Group symbols together.
   std::unordered_map<SymbolIdx, CclsSemanticHighlightSymbol> grouped_symbols;
   for (auto [sym, refcnt] : file.symbol2refcnt) {
-    if (refcnt <= 0)
+    if (refcnt <= 0 ||
+        (lines && !(lines->first <= sym.range.start.line &&
+                    sym.range.start.line < lines->second)))
       continue;
     std::string_view detailed_name;
     SymbolKind parent_kind = SymbolKind::Unknown;
@@ -434,18 +466,20 @@ void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file) {
     std::sort(scratch.begin(), scratch.end(),
               [](auto &l, auto &r) { return l.first.start < r.first.start; });
     const auto &buf = wfile->buffer_content;
+    const auto &starts = wfile->line_starts;
     int l = 0, c = 0, i = 0, p = 0;
     auto mov = [&](int line, int col) {
-      if (l < line)
+      if (l < line) {
         c = 0;
-      for (; l < line && i < buf.size(); i++) {
-        if (buf[i] == '\n')
-          l++;
-        if (uint8_t(buf[i]) < 128 || 192 <= uint8_t(buf[i]))
-          p++;
+        // Jump to the start of |line|. The loop counting the skipped code
+        // points is vectorized by the compiler.
+        int j = line < (int)starts.size() ? starts[line] : (int)buf.size();
+        for (; i < j; i++)
+          p += uint8_t(buf[i]) < 128 || 192 <= uint8_t(buf[i]);
+        if (line >= (int)starts.size())
+          return true;
+        l = line;
       }
-      if (l < line)
-        return true;
       for (; c < col && i < buf.size() && buf[i] != '\n'; c++)
         if (p++, uint8_t(buf[i++]) >= 128)
           // Skip 0b10xxxxxx
@@ -468,6 +502,73 @@ void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file) {
   for (auto &entry : grouped_symbols)
     if (entry.second.ranges.size() || entry.second.lsRanges.size())
       params.symbols.push_back(std::move(entry.second));
-  pipeline::notify("$ccls/publishSemanticHighlight", params);
+  std::sort(params.symbols.begin(), params.symbols.end(),
+            [](auto &l, auto &r) { return l.key() < r.key(); });
+  return params;
+}
+} // namespace
+
+void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file,
+                           bool refresh) {
+  static GroupMatch match(g_config->highlight.whitelist,
+                          g_config->highlight.blacklist);
+  assert(file.def);
+  if (wfile->buffer_content.size() > g_config->highlight.largeFileSize ||
+      !match.matches(file.def->path))
+    return;
+
+  // Nothing to do unless the references in the file or the buffer changed.
+  auto [cache_it, first] = highlight_cache.try_emplace(wfile->filename);
+  HighlightCache &cache = cache_it->second;
+  if (!first && !refresh && cache.refcnt_gen == file.refcnt_gen &&
+      cache.version == wfile->version)
+    return;
+  cache.refcnt_gen = file.refcnt_gen;
+  cache.version = wfile->version;
+
+  CclsSemanticHighlight params =
+      computeSemanticHighlight(db, wfile, file, std::nullopt);
+  if (!first && params.symbols == cache.symbols)
+    return;
+
+  if (first || !g_config->highlight.delta) {
+    pipeline::broadcast("$ccls/publishSemanticHighlight", params);
+  } else {
+    // Merge the two sorted lists.
+    CclsSemanticHighlightDelta delta;
+    delta.uri = params.uri;
+    auto &olds = cache.symbols, &news = params.symbols;
+    size_t i = 0, j = 0;
+    while (i < olds.size() || j < news.size())
+      if (j == news.size() ||
+          (i < olds.size() && olds[i].key() < news[j].key())) {
+        delta.removed.push_back(olds[i++].key());
+      } else if (i == olds.size() || news[j].key() < olds[i].key()) {
+        delta.symbols.push_back(news[j++]);
+      } else {
+        if (!(olds[i] == news[j]))
+          delta.symbols.push_back(news[j]);
+        i++;
+        j++;
+      }
+    pipeline::broadcast("$ccls/publishSemanticHighlightDelta", delta);
+  }
+  cache.symbols = std::move(params.symbols);
+}
+
+void clearSemanticHighlight(const std::string &path) {
+  highlight_cache.erase(path);
+}
+
+void replySemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file,
+                            int begin, int end, ReplyOnce &reply) {
+  // Widen by one line on each side, as getIndexPosFromBufferPos may pick a
+  // nearby line if the buffer has been edited.
+  std::optional<int> b = wfile->getIndexPosFromBufferPos(begin, nullptr, false);
+  std::optional<int> e =
+      wfile->getIndexPosFromBufferPos(std::max(end - 1, begin), nullptr, true);
+  std::pair<int, int> lines{b ? std::max(*b - 1, 0) : 0,
+                            e ? *e + 2 : int(wfile->index_lines.size())};
+  reply(computeSemanticHighlight(db, wfile, file, lines));
 }
 } // namespace ccls
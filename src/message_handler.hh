@@ -6,6 +6,7 @@
 #include "lsp.hh"
 #include "query.hh"
 
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <optional>
@@ -20,9 +21,12 @@ struct WorkingFile;
 struct WorkingFiles;
 
 namespace pipeline {
+void notifyOrRequest(const char *method, bool request,
+                     const std::function<void(JsonWriter &)> &fn);
 void reply(const RequestId &id, const std::function<void(JsonWriter &)> &fn);
 void replyError(const RequestId &id,
                 const std::function<void(JsonWriter &)> &fn);
+bool isCancelled(const RequestId &id);
 } // namespace pipeline
 
 struct CodeActionParam {
@@ -173,6 +177,7 @@ struct DidChangeWorkspaceFoldersParam {
 };
 struct WorkspaceSymbolParam {
   std::string query;
+  RequestId partialResultToken;
 
   // ccls extensions
   std::vector<std::string> folders;
@@ -218,6 +223,8 @@ REFLECT_UNDERLYING_B(LanguageId);
 struct NotIndexed {
   std::string path;
 };
+// Thrown by MessageHandler::checkCancelled to abandon a request.
+struct Cancelled {};
 struct MessageHandler;
 
 struct ReplyOnce {
@@ -236,6 +243,47 @@ struct ReplyOnce {
   void replyLocationLink(std::vector<LocationLink> &result);
 };
 
+// If the client specified a partialResultToken, results are reported in
+// batches via $/progress while the handler is still computing, and the final
+// response is empty. Otherwise they are accumulated and sent by finish().
+template <typename T> struct PartialResult {
+  RequestId token;
+  std::vector<T> batch;
+  // Number of results, including those already reported.
+  size_t count = 0;
+  // Start small so that the first hits arrive quickly, then grow to amortize
+  // the notification overhead.
+  size_t batch_size = 64;
+
+  PartialResult(RequestId token) : token(std::move(token)) {}
+  void push(T &&item) {
+    batch.push_back(std::move(item));
+    count++;
+    if (token.valid() && batch.size() >= batch_size)
+      flush();
+  }
+  void flush() {
+    if (batch.empty())
+      return;
+    pipeline::notifyOrRequest("$/progress", false, [&](JsonWriter &w) {
+      w.startObject();
+      reflectMember(w, "token", token);
+      reflectMember(w, "value", batch);
+      w.endObject();
+    });
+    batch.clear();
+    batch_size = std::min(batch_size * 2, size_t(4096));
+  }
+  void finish(ReplyOnce &reply) {
+    if (token.valid()) {
+      flush();
+      reply(std::vector<T>());
+    } else {
+      reply(batch);
+    }
+  }
+};
+
 struct MessageHandler {
   SemaManager *manager = nullptr;
   DB *db = nullptr;
@@ -248,9 +296,17 @@ struct MessageHandler {
   llvm::StringMap<std::function<void(JsonReader &, ReplyOnce &)>>
       method2request;
   bool overdue = false;
+  // The request being handled.
+  RequestId cur_id;
 
   MessageHandler();
   void run(InMessage &msg);
+  // Called from the traversal loops of expensive requests. Throws Cancelled if
+  // the client has sent $/cancelRequest for the current request.
+  void checkCancelled() const {
+    if (pipeline::isCancelled(cur_id))
+      throw Cancelled{};
+  }
   QueryFile *findFile(const std::string &path, int *out_file_id = nullptr);
   std::pair<QueryFile *, WorkingFile *> findOrFail(const std::string &path,
                                                    ReplyOnce &reply,
@@ -274,6 +330,7 @@ private:
   void ccls_member(JsonReader &, ReplyOnce &);
   void ccls_navigate(JsonReader &, ReplyOnce &);
   void ccls_reload(JsonReader &);
+  void ccls_semanticHighlight(JsonReader &, ReplyOnce &);
   void ccls_vars(JsonReader &, ReplyOnce &);
   void callHierarchy_incomingCalls(CallsParam &param, ReplyOnce &);
   void callHierarchy_outgoingCalls(CallsParam &param, ReplyOnce &);
@@ -316,5 +373,15 @@ private:
 
 void emitSkippedRanges(WorkingFile *wfile, QueryFile &file);
 
-void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file);
+// Publishes the semantic highlight of |wfile| if it may have changed. Symbol
+// kinds come from defs in other files, which the generation of |file| does not
+// track; |refresh| recomputes regardless, e.g. after the project is loaded.
+void emitSemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file,
+                           bool refresh = false);
+// Forgets what has been published for |path| so that the next
+// emitSemanticHighlight sends the full highlight.
+void clearSemanticHighlight(const std::string &path);
+// Replies with the semantic highlight of the buffer lines [begin, end).
+void replySemanticHighlight(DB *db, WorkingFile *wfile, QueryFile &file,
+                            int begin, int end, ReplyOnce &reply);
 } // namespace ccls
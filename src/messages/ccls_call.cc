@@ -75,6 +75,7 @@ REFLECT_STRUCT(Out_outgoingCall, to, fromRanges);
 
 bool expand(MessageHandler *m, Out_cclsCall *entry, bool callee,
             CallType call_type, bool qualified, int levels) {
+  m->checkCancelled();
   const QueryFunc &func = m->db->getFunc(entry->usr);
   const QueryFunc::Def *def = func.anyDef();
   entry->numChildren = 0;
@@ -48,6 +48,7 @@ bool expand(MessageHandler *m, Out_cclsInheritance *entry, bool derived,
 template <typename Q>
 bool expandHelper(MessageHandler *m, Out_cclsInheritance *entry, bool derived,
                   bool qualified, int levels, Q &entity) {
+  m->checkCancelled();
   const auto *def = entity.anyDef();
   if (def) {
     entry->name = def->name(qualified);
@@ -55,7 +56,8 @@ bool expandHelper(MessageHandler *m, Out_cclsInheritance *entry, bool derived,
       if (auto loc = getLsLocation(m->db, m->wfiles, *def->spell))
         entry->location = *loc;
     } else if (entity.declarations.size()) {
-      if (auto loc = getLsLocation(m->db, m->wfiles, entity.declarations[0]))
+      if (auto loc =
+              getLsLocation(m->db, m->wfiles, entity.declarations.front()))
         entry->location = *loc;
     }
   } else if (!derived) {
@@ -164,7 +164,7 @@ bool expand(MessageHandler *m, Out_cclsMember *entry, bool qualified,
                     entry1.location = *loc;
                 } else if (func1.declarations.size()) {
                   if (auto loc = getLsLocation(m->db, m->wfiles,
-                                               func1.declarations[0]))
+                                               func1.declarations.front()))
                     entry1.location = *loc;
                 }
                 entry->children.push_back(std::move(entry1));
@@ -184,7 +184,7 @@ bool expand(MessageHandler *m, Out_cclsMember *entry, bool qualified,
                     entry1.location = *loc;
                 } else if (type1.declarations.size()) {
                   if (auto loc = getLsLocation(m->db, m->wfiles,
-                                               type1.declarations[0]))
+                                               type1.declarations.front()))
                     entry1.location = *loc;
                 }
                 entry->children.push_back(std::move(entry1));
@@ -0,0 +1,35 @@
+// Copyright 2017-2018 ccls Authors
+// SPDX-License-Identifier: Apache-2.0
+
+#include "message_handler.hh"
+#include "query.hh"
+
+namespace ccls {
+namespace {
+struct Param {
+  TextDocumentIdentifier textDocument;
+  // The lines to highlight, typically the viewport. The whole file if not
+  // specified.
+  std::optional<lsRange> range;
+};
+REFLECT_STRUCT(Param, textDocument, range);
+} // namespace
+
+// Unlike $ccls/publishSemanticHighlight, this is not subject to
+// highlight.largeFileSize. The client can request the visible lines first and
+// the rest of the file as it is scrolled to.
+void MessageHandler::ccls_semanticHighlight(JsonReader &reader,
+                                            ReplyOnce &reply) {
+  Param param;
+  reflect(reader, param);
+  auto [file, wf] = findOrFail(param.textDocument.uri.getPath(), reply);
+  if (!wf)
+    return;
+  int begin = 0, end = wf->buffer_lines.size();
+  if (param.range) {
+    begin = param.range->start.line;
+    end = param.range->end.line + 1;
+  }
+  replySemanticHighlight(db, wf, *file, begin, end, reply);
+}
+} // namespace ccls
@@ -268,6 +268,16 @@ void *indexer(void *arg_) {
   pipeline::threadLeave();
   return nullptr;
 }
+
+InitializeResult initializeResult() {
+  InitializeResult result;
+  auto &c = result.capabilities;
+  c.documentOnTypeFormattingProvider =
+      g_config->capabilities.documentOnTypeFormattingProvider;
+  c.foldingRangeProvider = g_config->capabilities.foldingRangeProvider;
+  c.workspace = g_config->capabilities.workspace;
+  return result;
+}
 } // namespace
 
 void do_initialize(MessageHandler *m, InitializeParam &param,
@@ -332,15 +342,7 @@ void do_initialize(MessageHandler *m, InitializeParam &param,
 
   // Send initialization before starting indexers, so we don't send a
   // status update too early.
-  {
-    InitializeResult result;
-    auto &c = result.capabilities;
-    c.documentOnTypeFormattingProvider =
-        g_config->capabilities.documentOnTypeFormattingProvider;
-    c.foldingRangeProvider = g_config->capabilities.foldingRangeProvider;
-    c.workspace = g_config->capabilities.workspace;
-    reply(result);
-  }
+  reply(initializeResult());
 
   // Set project root.
   ensureEndsInSlash(project_path);
@@ -397,6 +399,7 @@ void do_initialize(MessageHandler *m, InitializeParam &param,
   m->project->index(m->wfiles, reply.id);
 
   m->manager->sessions.setCapacity(g_config->session.maxNum);
+  m->manager->startWorkers();
 }
 
 void MessageHandler::initialize(JsonReader &reader, ReplyOnce &reply) {
@@ -417,6 +420,20 @@ void MessageHandler::initialize(JsonReader &reader, ReplyOnce &reply) {
     reply.error(ErrorCode::InvalidRequest, "expected rootUri");
     return;
   }
+  // In daemon mode, later clients attach to the project loaded by the first
+  // one.
+  if (g_config) {
+    if (normalizePath(param.rootUri->getPath()) + '/' !=
+        g_config->fallbackFolder) {
+      LOG_S(WARNING) << "reject rootUri " << param.rootUri->raw_uri
+                     << " of an additional client";
+      reply.error(ErrorCode::InvalidRequest,
+                  "the daemon serves " + g_config->fallbackFolder);
+      return;
+    }
+    reply(initializeResult());
+    return;
+  }
   do_initialize(this, param, reply);
 }
 
@@ -189,7 +189,7 @@ void MessageHandler::workspace_executeCommand(JsonReader &reader,
     reflect(json_reader, cmd);
     std::vector<Location> result;
     auto map = [&](auto &&uses) {
-      for (auto &use : uses)
+      for (const auto &use : uses)
         if (auto loc = getLsLocation(db, wfiles, use))
           result.push_back(std::move(*loc));
     };
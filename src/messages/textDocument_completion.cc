@@ -13,6 +13,7 @@
 #include <clang/Sema/Sema.h>
 #include <llvm/ADT/Twine.h>
 
+#include <numeric>
 #if LLVM_VERSION_MAJOR < 8
 #include <regex>
 #endif
@@ -102,10 +103,13 @@ ParseIncludeLineResult ParseIncludeLine(const std::string &line) {
 
 // Pre-filters completion responses before sending to vscode. This results in a
 // significantly snappier completion experience as vscode is easily overloaded
-// when given 1000+ completion items.
+// when given 1000+ completion items. If |matched| is not null and
+// |complete_text| is not empty, the indices of the items that fuzzy match it
+// are appended.
 void filterCandidates(CompletionList &result, const std::string &complete_text,
                       Position begin_pos, Position end_pos,
-                      const std::string &buffer_line) {
+                      const std::string &buffer_line,
+                      std::vector<int> *matched = nullptr) {
   assert(begin_pos.line == end_pos.line);
   auto &items = result.items;
 
@@ -193,6 +197,10 @@ void filterCandidates(CompletionList &result, const std::string &complete_text,
                         ? fuzzy.match(filter, true)
                         : FuzzyMatcher::kMinScore;
     }
+    if (matched)
+      for (size_t i = 0; i < items.size(); i++)
+        if (items[i].score_ > FuzzyMatcher::kMinScore)
+          matched->push_back(i);
     items.erase(std::remove_if(items.begin(), items.end(),
                                [](const CompletionItem &item) {
                                  return item.score_ <= FuzzyMatcher::kMinScore;
@@ -418,10 +426,9 @@ class CompletionConsumer : public CodeCompleteConsumer {
   CodeCompletionTUInfo cctu_info;
 
 public:
-  bool from_cache;
   std::vector<CompletionItem> ls_items;
 
-  CompletionConsumer(const CodeCompleteOptions &opts, bool from_cache)
+  CompletionConsumer(const CodeCompleteOptions &opts)
       :
 #if LLVM_VERSION_MAJOR >= 9 // rC358696
         CodeCompleteConsumer(opts),
@@ -429,7 +436,7 @@ public:
         CodeCompleteConsumer(opts, false),
 #endif
         alloc(std::make_shared<clang::GlobalCodeCompletionAllocator>()),
-        cctu_info(alloc), from_cache(from_cache) {
+        cctu_info(alloc) {
   }
 
   void ProcessCodeCompleteResults(Sema &s, CodeCompletionContext context,
@@ -512,11 +519,20 @@ public:
   CodeCompletionAllocator &getAllocator() override { return *alloc; }
   CodeCompletionTUInfo &getCodeCompletionTUInfo() override { return cctu_info; }
 };
+
+// A completion result and the indices of the items matching the filter of the
+// latest request. Items not matching a filter cannot match its extensions, so
+// only the matched items are rescored while the user keeps typing.
+struct CachedCompletion {
+  std::vector<CompletionItem> items;
+  std::string filter;
+  std::vector<int> matched;
+};
 } // namespace
 
 void MessageHandler::textDocument_completion(CompletionParam &param,
                                              ReplyOnce &reply) {
-  static CompleteConsumerCache<std::vector<CompletionItem>> cache;
+  static CompleteConsumerCache<CachedCompletion> cache;
   std::string path = param.textDocument.uri.getPath();
   WorkingFile *wf = wfiles->getFile(path);
   if (!wf) {
@@ -590,35 +606,53 @@ void MessageHandler::textDocument_completion(CompletionParam &param,
   }
 #endif
 
+  int64_t preamble_gen = manager->preambleGeneration(path);
+  bool hit = cache.withResult(
+      path, buffer_line, begin_pos, preamble_gen, [&](CachedCompletion &c) {
+        std::vector<int> candidates;
+        if (g_config->completion.filterAndSort && c.filter.size() &&
+            filter.compare(0, c.filter.size(), c.filter) == 0) {
+          candidates = c.matched;
+        } else {
+          candidates.resize(c.items.size());
+          std::iota(candidates.begin(), candidates.end(), 0);
+        }
+        result.items.reserve(candidates.size());
+        for (int i : candidates)
+          result.items.push_back(c.items[i]);
+        std::vector<int> matched;
+        filterCandidates(result, filter, begin_pos, end_pos, buffer_line,
+                         &matched);
+        for (int &i : matched)
+          i = candidates[i];
+        c.filter = filter;
+        c.matched = std::move(matched);
+      });
+  if (hit) {
+    reply(result);
+    return;
+  }
+
   SemaManager::OnComplete callback =
-      [filter, path, begin_pos, end_pos, reply,
-       buffer_line](CodeCompleteConsumer *optConsumer) {
+      [filter, path, begin_pos, end_pos, reply, buffer_line,
+       preamble_gen](CodeCompleteConsumer *optConsumer) {
         if (!optConsumer)
           return;
         auto *consumer = static_cast<CompletionConsumer *>(optConsumer);
         CompletionList result;
         result.items = consumer->ls_items;
 
-        filterCandidates(result, filter, begin_pos, end_pos, buffer_line);
+        std::vector<int> matched;
+        filterCandidates(result, filter, begin_pos, end_pos, buffer_line,
+                         &matched);
         reply(result);
-        if (!consumer->from_cache) {
-          cache.withLock([&]() {
-            cache.path = path;
-            cache.line = buffer_line;
-            cache.position = begin_pos;
-            cache.result = consumer->ls_items;
-          });
-        }
+        cache.insert(path, buffer_line, begin_pos, preamble_gen,
+                     {std::move(consumer->ls_items), filter,
+                      std::move(matched)},
+                     g_config->completion.cacheSize);
       };
-
-  if (cache.isCacheValid(path, buffer_line, begin_pos)) {
-    CompletionConsumer consumer(ccOpts, true);
-    cache.withLock([&]() { consumer.ls_items = cache.result; });
-    callback(&consumer);
-  } else {
-    manager->comp_tasks.pushBack(std::make_unique<SemaManager::CompTask>(
-        reply.id, param.textDocument.uri.getPath(), begin_pos,
-        std::make_unique<CompletionConsumer>(ccOpts, false), ccOpts, callback));
-  }
+  manager->comp_tasks.pushBack(std::make_unique<SemaManager::CompTask>(
+      reply.id, param.textDocument.uri.getPath(), begin_pos,
+      std::make_unique<CompletionConsumer>(ccOpts), ccOpts, callback));
 }
 } // namespace ccls
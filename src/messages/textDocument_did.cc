@@ -23,6 +23,7 @@ void MessageHandler::textDocument_didClose(TextDocumentParam &param) {
   std::string path = param.textDocument.uri.getPath();
   wfiles->onClose(path);
   manager->onClose(path);
+  clearSemanticHighlight(path);
   pipeline::removeCache(path);
 }
 
@@ -34,6 +35,7 @@ void MessageHandler::textDocument_didOpen(DidOpenTextDocumentParam &param) {
     wf->setIndexContent(*cached_file_contents);
 
   QueryFile *file = findFile(path);
+  clearSemanticHighlight(wf->filename);
   if (file) {
     emitSkippedRanges(wf, *file);
     emitSemanticHighlight(db, wf, *file);
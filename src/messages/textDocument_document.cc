@@ -85,7 +85,7 @@ void MessageHandler::textDocument_documentLink(TextDocumentParam &param,
   for (const IndexInclude &include : file->def->includes)
     if (std::optional<int> bline =
             wf->getBufferPosFromIndexPos(include.line, &column, false)) {
-      const std::string &line = wf->buffer_lines[*bline];
+      std::string_view line = wf->buffer_lines[*bline];
       auto start = line.find_first_of("\"<"), end = line.find_last_of("\">");
       if (start < end)
         result.push_back({lsRange{{*bline, (int)start + 1}, {*bline, (int)end}},
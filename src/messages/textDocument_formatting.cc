@@ -82,7 +82,7 @@ void MessageHandler::textDocument_onTypeFormatting(
     return;
   }
   std::string_view code = wf->buffer_content;
-  int pos = getOffsetForPosition(param.position, code);
+  int pos = wf->getOffset(param.position);
   auto lbrace = code.find_last_of('{', pos);
   if (lbrace == std::string::npos)
     lbrace = pos;
@@ -95,9 +95,8 @@ void MessageHandler::textDocument_rangeFormatting(
   if (!wf) {
     return;
   }
-  std::string_view code = wf->buffer_content;
-  int begin = getOffsetForPosition(param.range.start, code),
-      end = getOffsetForPosition(param.range.end, code);
+  int begin = wf->getOffset(param.range.start),
+      end = wf->getOffset(param.range.end);
   format(reply, wf, {(unsigned)begin, unsigned(end - begin)});
 }
 } // namespace ccls
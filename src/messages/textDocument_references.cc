@@ -27,73 +27,108 @@ struct ReferenceParam : public TextDocumentPositionParam {
   Role excludeRole = Role::None;
   // Include references with all |Role| bits set.
   Role role = Role::None;
+
+  RequestId partialResultToken;
 };
 REFLECT_STRUCT(ReferenceParam::Context, includeDeclaration);
 REFLECT_STRUCT(ReferenceParam, textDocument, position, context, folders, base,
-               excludeRole, role);
+               excludeRole, role, partialResultToken);
 } // namespace
 
 void MessageHandler::textDocument_references(JsonReader &reader,
                                              ReplyOnce &reply) {
   ReferenceParam param;
   reflect(reader, param);
-  auto [file, wf] = findOrFail(param.textDocument.uri.getPath(), reply);
+  int file_id;
+  auto [file, wf] =
+      findOrFail(param.textDocument.uri.getPath(), reply, &file_id);
   if (!wf)
     return;
 
   for (auto &folder : param.folders)
     ensureEndsInSlash(folder);
   std::vector<uint8_t> file_set = db->getFileSet(param.folders);
-  std::vector<Location> result;
+  PartialResult<Location> result(param.partialResultToken);
+  size_t max_num = g_config->xref.maxNum;
+
+  // With xref.nearestFirst, visit the current file (pass 1), then other open
+  // files (pass 2), then the rest (pass 0). |file_set| and the limit are
+  // checked before decoding references of a file, so that a capped query on a
+  // hot symbol costs O(maxNum) rather than O(total uses).
+  std::vector<uint8_t> file2pass(db->files.size());
+  std::vector<uint8_t> passes{0};
+  if (g_config->xref.nearestFirst) {
+    wfiles->withLock([&]() {
+      for (auto &[path, _] : wfiles->files) {
+        auto it = db->name2file_id.find(lowerPathIfInsensitive(path));
+        if (it != db->name2file_id.end())
+          file2pass[it->second] = 2;
+      }
+    });
+    file2pass[file_id] = 1;
+    passes = {1, 2, 0};
+  }
 
   std::unordered_set<Use> seen_uses;
   int line = param.position.line;
+  auto fn = [&](Use use) {
+    checkCancelled();
+    if (result.count >= max_num)
+      return false;
+    if (Role(use.role & param.role) == param.role &&
+        !(use.role & param.excludeRole) && seen_uses.insert(use).second)
+      if (auto loc = getLsLocation(db, wfiles, use))
+        result.push(std::move(*loc));
+    return result.count < max_num;
+  };
+  auto visit = [&](const auto &refs, uint8_t pass) {
+    for (size_t i = 0; i < refs.index.size(); i++) {
+      int file_id = refs.index[i].file_id;
+      if (file_set[file_id] && file2pass[file_id] == pass)
+        for (Use use : refs.inBucket(i))
+          if (!fn(use))
+            return false;
+    }
+    return true;
+  };
 
   for (SymbolRef sym : findSymbolsAtLocation(wf, file, param.position)) {
-    // Found symbol. Return references.
+    // Found symbol. Collect it and, for functions, its bases.
+    std::vector<SymbolIdx> syms{sym};
     std::unordered_set<Usr> seen;
     seen.insert(sym.usr);
-    std::vector<Usr> stack{sym.usr};
     if (sym.kind != Kind::Func)
       param.base = false;
-    while (stack.size()) {
-      sym.usr = stack.back();
-      stack.pop_back();
-      auto fn = [&](Use use, SymbolKind parent_kind) {
-        if (file_set[use.file_id] &&
-            Role(use.role & param.role) == param.role &&
-            !(use.role & param.excludeRole) && seen_uses.insert(use).second)
-          if (auto loc = getLsLocation(db, wfiles, use))
-            result.push_back(*loc);
-      };
-      withEntity(db, sym, [&](const auto &entity) {
-        SymbolKind parent_kind = SymbolKind::Unknown;
-        for (auto &def : entity.def)
-          if (def.spell) {
-            parent_kind = getSymbolKind(db, sym);
-            if (param.base)
-              for (Usr usr : make_range(def.bases_begin(), def.bases_end()))
-                if (!seen.count(usr)) {
-                  seen.insert(usr);
-                  stack.push_back(usr);
-                }
-            break;
-          }
-        for (Use use : entity.uses)
-          fn(use, parent_kind);
-        if (param.context.includeDeclaration) {
-          for (auto &def : entity.def)
-            if (def.spell)
-              fn(*def.spell, parent_kind);
-          for (Use use : entity.declarations)
-            fn(use, parent_kind);
-        }
+    for (size_t i = 0; i < syms.size(); i++)
+      eachEntityDef(db, syms[i], [&](const auto &def) {
+        if (!def.spell)
+          return true;
+        if (param.base)
+          for (Usr usr : make_range(def.bases_begin(), def.bases_end()))
+            if (seen.insert(usr).second)
+              syms.push_back({usr, sym.kind});
+        return false;
       });
-    }
+
+    // Return references.
+    bool more = result.count < max_num;
+    for (size_t i = 0; more && i < passes.size(); i++)
+      for (size_t j = 0; more && j < syms.size(); j++)
+        withEntity(db, syms[j], [&](const auto &entity) {
+          uint8_t pass = passes[i];
+          more = visit(entity.uses, pass);
+          if (more && param.context.includeDeclaration) {
+            for (auto &def : entity.def)
+              if (more && def.spell && file_set[def.spell->file_id] &&
+                  file2pass[def.spell->file_id] == pass)
+                more = fn(*def.spell);
+            more = more && visit(entity.declarations, pass);
+          }
+        });
     break;
   }
 
-  if (result.empty()) {
+  if (!result.count) {
     // |path| is the #include line. If the cursor is not on such line but line
     // = 0,
     // use the current filename.
@@ -111,15 +146,15 @@ void MessageHandler::textDocument_references(JsonReader &reader,
           for (const IndexInclude &include : file1.def->includes)
             if (include.resolved_path == path) {
               // Another file |file1| has the same include line.
-              Location &loc = result.emplace_back();
+              Location loc;
               loc.uri = DocumentUri::fromPath(file1.def->path);
               loc.range.start.line = loc.range.end.line = include.line;
+              if (result.count < max_num)
+                result.push(std::move(loc));
               break;
             }
   }
 
-  if ((int)result.size() >= g_config->xref.maxNum)
-    result.resize(g_config->xref.maxNum);
-  reply(result);
+  result.finish(reply);
 }
 } // namespace ccls
@@ -37,8 +37,8 @@ WorkspaceEdit buildWorkspaceEdit(DB *db, WorkingFiles *wfiles, SymbolRef sym,
     }
     // TODO LoadIndexedContent if wf is nullptr.
     if (WorkingFile *wf = it->second.first) {
-      int start = getOffsetForPosition(loc->range.start, wf->buffer_content),
-          end = getOffsetForPosition(loc->range.end, wf->buffer_content);
+      int start = wf->getOffset(loc->range.start),
+          end = wf->getOffset(loc->range.end);
       if (wf->buffer_content.compare(start, end - start, old_text))
         return;
     }
@@ -167,29 +167,28 @@ void MessageHandler::textDocument_signatureHelp(
     begin_pos = wf->getCompletionPosition(param.position, &filter);
   }
 
+  int64_t preamble_gen = manager->preambleGeneration(path);
   SemaManager::OnComplete callback =
-      [reply, path, begin_pos, buffer_line](CodeCompleteConsumer *optConsumer) {
+      [reply, path, begin_pos, buffer_line,
+       preamble_gen](CodeCompleteConsumer *optConsumer) {
         if (!optConsumer)
           return;
         auto *consumer = static_cast<SignatureHelpConsumer *>(optConsumer);
         reply(consumer->ls_sighelp);
-        if (!consumer->from_cache) {
-          cache.withLock([&]() {
-            cache.path = path;
-            cache.line = buffer_line;
-            cache.position = begin_pos;
-            cache.result = consumer->ls_sighelp;
-          });
-        }
+        if (!consumer->from_cache)
+          cache.insert(path, buffer_line, begin_pos, preamble_gen,
+                       consumer->ls_sighelp, g_config->completion.cacheSize);
       };
 
   CodeCompleteOptions ccOpts;
   ccOpts.IncludeGlobals = false;
   ccOpts.IncludeMacros = false;
   ccOpts.IncludeBriefComments = true;
-  if (cache.isCacheValid(path, buffer_line, begin_pos)) {
+  SignatureHelp cached;
+  if (cache.withResult(path, buffer_line, begin_pos, preamble_gen,
+                       [&](SignatureHelp &result) { cached = result; })) {
     SignatureHelpConsumer consumer(ccOpts, true);
-    cache.withLock([&]() { consumer.ls_sighelp = cache.result; });
+    consumer.ls_sighelp = std::move(cached);
     callback(&consumer);
   } else {
     manager->comp_tasks.pushBack(std::make_unique<SemaManager::CompTask>(
@@ -125,7 +125,7 @@ bool addSymbol(
   });
   if (!dr) {
     auto &decls = getNonDefDeclarations(db, sym);
-    for (auto &dr1 : decls) {
+    for (DeclRef dr1 : decls) {
       dr = dr1;
       if (!in_folder && (in_folder = file_set[dr1.file_id]))
         break;
@@ -145,7 +145,7 @@ bool addSymbol(
 
 void MessageHandler::workspace_symbol(WorkspaceSymbolParam &param,
                                       ReplyOnce &reply) {
-  std::vector<SymbolInformation> result;
+  PartialResult<SymbolInformation> result(param.partialResultToken);
   const std::string &query = param.query;
   for (auto &folder : param.folders)
     ensureEndsInSlash(folder);
@@ -154,6 +154,11 @@ void MessageHandler::workspace_symbol(WorkspaceSymbolParam &param,
   // {symbol info, matching detailed_name or short_name, index}
   std::vector<std::tuple<SymbolInformation, int, SymbolIdx>> cands;
   bool sensitive = g_config->workspaceSymbol.caseSensitivity;
+  bool sort =
+      g_config->workspaceSymbol.sort && query.size() <= FuzzyMatcher::kMaxPat;
+  std::optional<FuzzyMatcher> fuzzy;
+  if (sort)
+    fuzzy.emplace(query, sensitive);
 
   // Find subsequence matches.
   std::string query_without_space;
@@ -162,14 +167,38 @@ void MessageHandler::workspace_symbol(WorkspaceSymbolParam &param,
     if (!isspace(c))
       query_without_space += c;
 
+  // Move |cands| to |result|. When streaming, this is called for each batch
+  // and the fuzzy sort only orders candidates within the batch.
+  auto flush = [&]() {
+    if (sort) {
+      // Sort results with a fuzzy matching algorithm.
+      for (auto &cand : cands)
+        std::get<1>(cand) = fuzzy->match(
+            db->getSymbolName(std::get<2>(cand), std::get<1>(cand)), false);
+      std::sort(cands.begin(), cands.end(), [](const auto &l, const auto &r) {
+        return std::get<1>(l) > std::get<1>(r);
+      });
+    }
+    for (auto &cand : cands) {
+      // Discard awful candidates.
+      if (sort && std::get<1>(cand) <= FuzzyMatcher::kMinScore)
+        break;
+      result.push(std::move(std::get<0>(cand)));
+    }
+    cands.clear();
+  };
+  size_t num = 0;
   auto add = [&](SymbolIdx sym) {
+    checkCancelled();
     std::string_view detailed_name = db->getSymbolName(sym, true);
     int pos = reverseSubseqMatch(query_without_space, detailed_name, sensitive);
-    return pos >= 0 &&
-           addSymbol(db, wfiles, file_set, sym,
-                     detailed_name.find(':', pos) != std::string::npos,
-                     &cands) &&
-           cands.size() >= g_config->workspaceSymbol.maxNum;
+    if (pos < 0 ||
+        !addSymbol(db, wfiles, file_set, sym,
+                   detailed_name.find(':', pos) != std::string::npos, &cands))
+      return false;
+    if (result.token.valid() && cands.size() >= result.batch_size)
+      flush();
+    return ++num >= g_config->workspaceSymbol.maxNum;
   };
   for (auto &func : db->funcs)
     if (add({func.usr, Kind::Func}))
@@ -181,33 +210,7 @@ void MessageHandler::workspace_symbol(WorkspaceSymbolParam &param,
     if (var.def.size() && !var.def[0].is_local() && add({var.usr, Kind::Var}))
       goto done_add;
 done_add:
-
-  if (g_config->workspaceSymbol.sort && query.size() <= FuzzyMatcher::kMaxPat) {
-    // Sort results with a fuzzy matching algorithm.
-    int longest = 0;
-    for (auto &cand : cands)
-      longest = std::max(
-          longest, int(db->getSymbolName(std::get<2>(cand), true).size()));
-    FuzzyMatcher fuzzy(query, g_config->workspaceSymbol.caseSensitivity);
-    for (auto &cand : cands)
-      std::get<1>(cand) = fuzzy.match(
-          db->getSymbolName(std::get<2>(cand), std::get<1>(cand)), false);
-    std::sort(cands.begin(), cands.end(), [](const auto &l, const auto &r) {
-      return std::get<1>(l) > std::get<1>(r);
-    });
-    result.reserve(cands.size());
-    for (auto &cand : cands) {
-      // Discard awful candidates.
-      if (std::get<1>(cand) <= FuzzyMatcher::kMinScore)
-        break;
-      result.push_back(std::get<0>(cand));
-    }
-  } else {
-    result.reserve(cands.size());
-    for (auto &cand : cands)
-      result.push_back(std::get<0>(cand));
-  }
-
-  reply(result);
+  flush();
+  result.finish(reply);
 }
 } // namespace ccls
@@ -17,16 +17,32 @@
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
 
+#include <llvm/ADT/StringSet.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/Process.h>
 #include <llvm/Support/Threading.h>
 
+#include <array>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
 #include <mutex>
+#include <set>
 #include <shared_mutex>
+#include <string.h>
 #include <thread>
-#ifndef _WIN32
+#include <unordered_map>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 #endif
 using namespace llvm;
@@ -99,7 +115,121 @@ MultiQueueWaiter *stdout_waiter;
 ThreadedQueue<InMessage> *on_request;
 ThreadedQueue<IndexRequest> *index_request;
 ThreadedQueue<IndexUpdate> *on_indexed;
-ThreadedQueue<std::string> *for_stdout;
+
+struct OutMessage {
+  // -1 for notifications sent to every client.
+  int client;
+  std::unique_ptr<rapidjson::StringBuffer> buf;
+};
+ThreadedQueue<OutMessage> *for_stdout;
+
+// Serialization buffers are recycled by the stdout thread so that their
+// storage is reused by later messages.
+std::mutex out_pool_mtx;
+std::vector<std::unique_ptr<rapidjson::StringBuffer>> out_pool;
+
+// Daemon mode: connected clients, keyed by the id stamped on their messages.
+// Each client has a writer thread fed by |queue|, so a client that stops
+// reading only stalls itself. The fd is closed when the last reference goes
+// away, so the writer can finish with a client that the main thread has just
+// dropped.
+struct Client {
+  int fd;
+  // Paths of the documents this client has opened. Only accessed by the main
+  // thread.
+  StringSet<> open;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  // Messages waiting to be written. A broadcast shares its buffer among the
+  // clients, which is returned to the pool after the last write.
+  std::deque<std::shared_ptr<rapidjson::StringBuffer>> queue;
+  bool closed = false;
+
+  // Stops the writer and makes the reader see EOF, which synthesizes "exit".
+  void close() {
+    {
+      std::lock_guard lock(mtx);
+      closed = true;
+      queue.clear();
+    }
+    cv.notify_one();
+#ifndef _WIN32
+    ::shutdown(fd, SHUT_RDWR);
+#endif
+  }
+
+  ~Client() {
+#ifndef _WIN32
+    ::close(fd);
+#endif
+  }
+};
+// Messages queued for a client that does not read them. Beyond this the
+// client is disconnected.
+const size_t kMaxClientQueue = 1 << 14;
+bool server_mode;
+std::mutex clients_mtx;
+std::unordered_map<int, std::shared_ptr<Client>> clients;
+// The client whose message the current thread is handling. Notifications
+// sent from elsewhere are broadcast.
+thread_local int cur_client = -1;
+
+// Requests named by $/cancelRequest, keyed by (client, id). The reader threads
+// insert and the main thread clears the set when it becomes idle, which also
+// drops ids of requests that had completed before the cancellation arrived.
+std::mutex cancelled_mtx;
+std::set<std::pair<int, std::string>> cancelled;
+std::atomic<size_t> num_cancelled;
+
+void cancel(const RequestId &id) {
+  std::lock_guard lock(cancelled_mtx);
+  cancelled.emplace(id.client, id.value);
+  num_cancelled.store(cancelled.size(), std::memory_order_relaxed);
+}
+
+void clearCancelled() {
+  if (!num_cancelled.load(std::memory_order_relaxed))
+    return;
+  std::lock_guard lock(cancelled_mtx);
+  cancelled.clear();
+  num_cancelled.store(0, std::memory_order_relaxed);
+}
+
+void replyCancelled(const RequestId &id) {
+  ResponseError err;
+  err.code = ErrorCode::RequestCancelled;
+  err.message = "cancelled";
+  replyError(id, err);
+}
+
+std::unique_ptr<rapidjson::StringBuffer> acquireOutBuffer() {
+  {
+    std::lock_guard lock(out_pool_mtx);
+    if (out_pool.size()) {
+      auto buf = std::move(out_pool.back());
+      out_pool.pop_back();
+      return buf;
+    }
+  }
+  return std::make_unique<rapidjson::StringBuffer>();
+}
+
+void releaseOutBuffer(std::unique_ptr<rapidjson::StringBuffer> buf) {
+  std::lock_guard lock(out_pool_mtx);
+  // Don't retain the storage of exceptionally large messages.
+  if (out_pool.size() >= 64 || buf->GetSize() > (1 << 20))
+    return;
+  buf->Clear();
+  out_pool.push_back(std::move(buf));
+}
+
+void releaseOutBuffers(std::vector<OutMessage> &msgs) {
+  for (auto &msg : msgs)
+    if (msg.buf)
+      releaseOutBuffer(std::move(msg.buf));
+  msgs.clear();
+}
 
 struct InMemoryIndexFile {
   std::string content;
@@ -109,7 +239,7 @@ std::shared_mutex g_index_mutex;
 std::unordered_map<std::string, InMemoryIndexFile> g_index;
 
 bool cacheInvalid(VFS *vfs, IndexFile *prev, const std::string &path,
-                  const std::vector<const char *> &args,
+                  const std::vector<const char *> &args, uint64_t args_hash,
                   const std::optional<std::string> &from) {
   {
     std::lock_guard<std::mutex> lock(vfs->mutex);
@@ -120,22 +250,22 @@ bool cacheInvalid(VFS *vfs, IndexFile *prev, const std::string &path,
     }
   }
 
-  // For inferred files, allow -o a a.cc -> -o b b.cc
-  StringRef stem = sys::path::stem(path);
-  int changed = -1, size = std::min(prev->args.size(), args.size());
-  for (int i = 0; i < size; i++)
-    if (strcmp(prev->args[i], args[i]) && sys::path::stem(args[i]) != stem) {
-      changed = i;
-      break;
-    }
-  if (changed < 0 && prev->args.size() != args.size())
-    changed = size;
-  if (changed >= 0)
+  // The hashes abstract out the arguments naming the main source file. For
+  // inferred files, this allows -o a a.cc -> -o b b.cc
+  if (prev->args_hash == args_hash)
+    return false;
+  if (LOG_V_ENABLED(1)) {
+    StringRef stem = sys::path::stem(path);
+    int changed = 0, size = std::min(prev->args.size(), args.size());
+    while (changed < size && (!strcmp(prev->args[changed], args[changed]) ||
+                              sys::path::stem(args[changed]) == stem))
+      changed++;
     LOG_V(1) << "args changed for " << path
              << (from ? " (via " + *from + ")" : std::string()) << "; old: "
              << (changed < prev->args.size() ? prev->args[changed] : "")
-             << "; new: " << (changed < size ? args[changed] : "");
-  return changed >= 0;
+             << "; new: " << (changed < args.size() ? args[changed] : "");
+  }
+  return true;
 };
 
 std::string appendSerializationFormat(const std::string &base) {
@@ -227,6 +357,7 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
   if (request.args.size())
     entry.args = request.args;
   std::string path_to_index = entry.filename;
+  uint64_t args_hash = argsFingerprint(entry, path_to_index);
   std::unique_ptr<IndexFile> prev;
 
   bool deleted = request.mode == IndexMode::Delete,
@@ -269,7 +400,7 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
       std::unique_lock lock(getFileMutex(path_to_index));
       prev = rawCacheLoad(path_to_index);
       if (!prev || prev->no_linkage < no_linkage ||
-          cacheInvalid(vfs, prev.get(), path_to_index, entry.args,
+          cacheInvalid(vfs, prev.get(), path_to_index, entry.args, args_hash,
                        std::nullopt))
         break;
       if (track)
@@ -393,6 +524,7 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
       continue;
     }
 
+    curr->args_hash = args_hash;
     if (!deleted)
       LOG_IF_S(INFO, loud) << "store index for " << path
                            << " (delta: " << !!prev << ")";
@@ -445,6 +577,12 @@ bool indexer_Parse(SemaManager *completion, WorkingFiles *wfiles,
 void quit(SemaManager &manager) {
   g_quit.store(true, std::memory_order_relaxed);
   manager.quit();
+  {
+    // Make the reader and writer threads of the clients leave.
+    std::lock_guard lock(clients_mtx);
+    for (auto &[_, c] : clients)
+      c->close();
+  }
 
   { std::lock_guard lock(index_request->mutex_); }
   indexer_waiter->cv.notify_all();
@@ -476,7 +614,7 @@ void init() {
   index_request = new ThreadedQueue<IndexRequest>(indexer_waiter);
 
   stdout_waiter = new MultiQueueWaiter;
-  for_stdout = new ThreadedQueue<std::string>(stdout_waiter);
+  for_stdout = new ThreadedQueue<OutMessage>(stdout_waiter);
 }
 
 void indexer_Main(SemaManager *manager, VFS *vfs, Project *project,
@@ -498,7 +636,7 @@ void main_OnIndexed(DB *db, WorkingFiles *wfiles, IndexUpdate *update) {
       if (db->name2file_id.find(path) == db->name2file_id.end())
         continue;
       QueryFile &file = db->files[db->name2file_id[path]];
-      emitSemanticHighlight(db, wf.get(), file);
+      emitSemanticHighlight(db, wf.get(), file, true);
     }
     return;
   }
@@ -520,43 +658,93 @@ void main_OnIndexed(DB *db, WorkingFiles *wfiles, IndexUpdate *update) {
   }
 }
 
-void launchStdin() {
-  threadEnter();
-  std::thread([]() {
-    set_thread_name("stdin");
-    std::string str;
-    const std::string_view kContentLength("Content-Length: ");
-    bool received_exit = false;
+namespace {
+// Reads Content-Length framed messages from a file descriptor. Headers are
+// scanned in a buffer that is refilled with whole chunks. The body is copied
+// from what is left in the buffer and the remainder is read directly into the
+// message buffer, which is then parsed in situ.
+struct FrameReader {
+  int fd;
+  char buf[1 << 16];
+  size_t pos = 0, end = 0;
+
+  FrameReader(int fd) : fd(fd) {}
+
+  ptrdiff_t readSome(char *p, size_t n) {
+#ifdef _WIN32
+    return _read(fd, p, unsigned(std::min(n, size_t(INT_MAX))));
+#else
+    ptrdiff_t r;
+    while ((r = ::read(fd, p, n)) < 0 && errno == EINTR)
+      ;
+    return r;
+#endif
+  }
+
+  // Reads a header line without the trailing \r\n. Returns false on EOF.
+  bool readLine(std::string &line) {
+    line.clear();
     while (true) {
-      int len = 0;
-      str.clear();
-      while (true) {
-        int c = getchar();
-        if (c == EOF)
-          goto quit;
-        if (c == '\n') {
-          if (str.empty())
-            break;
-          if (!str.compare(0, kContentLength.size(), kContentLength))
-            len = atoi(str.c_str() + kContentLength.size());
-          str.clear();
-        } else if (c != '\r') {
-          str += c;
-        }
+      if (pos == end) {
+        ptrdiff_t n = readSome(buf, sizeof buf);
+        if (n <= 0)
+          return false;
+        pos = 0;
+        end = n;
       }
-
-      str.resize(len);
-      for (int i = 0; i < len; ++i) {
-        int c = getchar();
-        if (c == EOF)
-          goto quit;
-        str[i] = c;
+      const char *p = buf + pos,
+                 *nl = static_cast<const char *>(memchr(p, '\n', end - pos));
+      line.append(p, nl ? nl : buf + end);
+      pos = nl ? nl - buf + 1 : end;
+      if (nl) {
+        if (line.size() && line.back() == '\r')
+          line.pop_back();
+        return true;
       }
+    }
+  }
+
+  bool readBody(char *out, size_t len) {
+    size_t n = std::min(len, end - pos);
+    memcpy(out, buf + pos, n);
+    pos += n;
+    while (n < len) {
+      ptrdiff_t r = readSome(out + n, len - n);
+      if (r <= 0)
+        return false;
+      n += r;
+    }
+    return true;
+  }
+};
 
-      auto message = std::make_unique<char[]>(len);
-      std::copy(str.begin(), str.end(), message.get());
+// Dispatches the messages of one connection to the main thread until "exit"
+// or EOF. An "exit" is synthesized in the latter case.
+void readMessages(int fd, int client) {
+  auto in = std::make_unique<FrameReader>(fd);
+  std::string str;
+  const std::string_view kContentLength("Content-Length: ");
+  bool received_exit = false;
+  while (true) {
+    size_t len = 0;
+    while (true) {
+      if (!in->readLine(str))
+        goto quit;
+      if (str.empty())
+        break;
+      if (!str.compare(0, kContentLength.size(), kContentLength))
+        len = atoll(str.c_str() + kContentLength.size());
+    }
+
+    {
+      // ParseInsitu requires a NUL terminator. The strings of |document|
+      // point into |message|, which is moved along with it.
+      auto message = std::make_unique<char[]>(len + 1);
+      if (!in->readBody(message.get(), len))
+        goto quit;
+      message[len] = 0;
       auto document = std::make_unique<rapidjson::Document>();
-      document->Parse(message.get(), len);
+      document->ParseInsitu(message.get());
       assert(!document->HasParseError());
 
       JsonReader reader{document.get()};
@@ -567,49 +755,204 @@ void launchStdin() {
       std::string method;
       reflectMember(reader, "id", id);
       reflectMember(reader, "method", method);
+      id.client = client;
       if (id.valid())
         LOG_V(2) << "receive RequestMessage: " << id.value << " " << method;
       else
         LOG_V(2) << "receive NotificationMessage " << method;
       if (method.empty())
         continue;
+      if (method == "$/cancelRequest") {
+        // Handled here so that a request being processed by the main thread
+        // observes the cancellation.
+        auto it = reader.m->FindMember("params");
+        if (it != reader.m->MemberEnd() && it->value.IsObject()) {
+          JsonReader params{&it->value};
+          RequestId cancel_id;
+          reflectMember(params, "id", cancel_id);
+          cancel_id.client = client;
+          if (cancel_id.valid())
+            cancel(cancel_id);
+        }
+        continue;
+      }
       received_exit = method == "exit";
       // g_config is not available before "initialize". Use 0 in that case.
-      on_request->pushBack(
-          {id, std::move(method), std::move(message), std::move(document),
-           chrono::steady_clock::now() +
-               chrono::milliseconds(g_config ? g_config->request.timeout : 0)});
+      InMessage msg{
+          id, std::move(method), std::move(message), std::move(document),
+          chrono::steady_clock::now() +
+              chrono::milliseconds(g_config ? g_config->request.timeout : 0)};
+      msg.client = client;
+      on_request->pushBack(std::move(msg));
 
       if (received_exit)
         break;
     }
+  }
 
-  quit:
-    if (!received_exit) {
-      const std::string_view str("{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}");
-      auto message = std::make_unique<char[]>(str.size());
-      std::copy(str.begin(), str.end(), message.get());
-      auto document = std::make_unique<rapidjson::Document>();
-      document->Parse(message.get(), str.size());
-      on_request->pushBack({RequestId(), std::string("exit"),
-                            std::move(message), std::move(document),
-                            chrono::steady_clock::now()});
-    }
+quit:
+  if (!received_exit) {
+    const std::string_view str("{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}");
+    auto message = std::make_unique<char[]>(str.size() + 1);
+    std::copy(str.begin(), str.end(), message.get());
+    message[str.size()] = 0;
+    auto document = std::make_unique<rapidjson::Document>();
+    document->ParseInsitu(message.get());
+    InMessage msg{RequestId(), std::string("exit"), std::move(message),
+                  std::move(document), chrono::steady_clock::now()};
+    msg.client = client;
+    on_request->pushBack(std::move(msg));
+  }
+}
+} // namespace
+
+void launchStdin() {
+  threadEnter();
+  std::thread([]() {
+    set_thread_name("stdin");
+    readMessages(0, 0);
     threadLeave();
   }).detach();
 }
 
+namespace {
+#ifndef _WIN32
+// Writes |iov| to |fd| with one writev per IOV_MAX entries. Returns false on
+// error, with errno set.
+bool writeAll(int fd, std::vector<iovec> &iov) {
+  const size_t max_iov = IOV_MAX;
+  for (size_t i = 0; i < iov.size();) {
+    ssize_t n = ::writev(fd, &iov[i], int(std::min(iov.size() - i, max_iov)));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    // Skip fully written entries and adjust a partially written one.
+    for (; i < iov.size() && size_t(n) >= iov[i].iov_len; i++)
+      n -= iov[i].iov_len;
+    if (i < iov.size()) {
+      iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + n;
+      iov[i].iov_len -= n;
+    }
+  }
+  return true;
+}
+#endif
+
+// Writes messages to |fd| with as few system calls as possible. On POSIX the
+// headers and bodies are gathered into one writev per IOV_MAX entries.
+// Returns false on error, with errno set.
+bool writeMessages(int fd, ArrayRef<rapidjson::StringBuffer *> bufs) {
+  if (bufs.empty())
+    return true;
+#ifdef _WIN32
+  for (auto *buf : bufs)
+    llvm::outs() << "Content-Length: " << buf->GetSize() << "\r\n\r\n"
+                 << StringRef(buf->GetString(), buf->GetSize());
+  llvm::outs().flush();
+  return true;
+#else
+  std::vector<std::array<char, 40>> headers(bufs.size());
+  std::vector<iovec> iov;
+  iov.reserve(bufs.size() * 2);
+  for (size_t i = 0; i < bufs.size(); i++) {
+    int n = snprintf(headers[i].data(), headers[i].size(),
+                     "Content-Length: %zu\r\n\r\n", bufs[i]->GetSize());
+    iov.push_back({headers[i].data(), size_t(n)});
+    iov.push_back(
+        {const_cast<char *>(bufs[i]->GetString()), bufs[i]->GetSize()});
+  }
+  return writeAll(fd, iov);
+#endif
+}
+
+// Hands |messages| to the writer threads of their clients. The buffers are
+// shared, not copied, by the clients of a broadcast.
+void routeMessages(std::vector<OutMessage> &messages) {
+  std::vector<std::pair<int, std::shared_ptr<Client>>> targets;
+  {
+    std::lock_guard lock(clients_mtx);
+    targets.assign(clients.begin(), clients.end());
+  }
+  std::vector<std::pair<int, std::shared_ptr<rapidjson::StringBuffer>>> bufs;
+  bufs.reserve(messages.size());
+  for (auto &msg : messages)
+    bufs.emplace_back(msg.client,
+                      std::shared_ptr<rapidjson::StringBuffer>(
+                          msg.buf.release(), [](rapidjson::StringBuffer *buf) {
+                            releaseOutBuffer(
+                                std::unique_ptr<rapidjson::StringBuffer>(buf));
+                          }));
+  for (auto &[id, c] : targets) {
+    bool overflow = false;
+    {
+      std::lock_guard lock(c->mtx);
+      if (c->closed)
+        continue;
+      for (auto &[client, buf] : bufs)
+        if (client == id || client < 0)
+          c->queue.push_back(buf);
+      overflow = c->queue.size() > kMaxClientQueue;
+    }
+    if (overflow) {
+      LOG_S(WARNING) << "client " << id << " is not reading; disconnect";
+      c->close();
+    } else {
+      c->cv.notify_one();
+    }
+  }
+}
+
+#ifndef _WIN32
+void writeClient(std::shared_ptr<Client> c, int id) {
+  std::deque<std::shared_ptr<rapidjson::StringBuffer>> pending;
+  std::vector<rapidjson::StringBuffer *> bufs;
+  while (true) {
+    {
+      std::unique_lock lock(c->mtx);
+      c->cv.wait(lock, [&]() { return c->closed || c->queue.size(); });
+      if (c->closed)
+        return;
+      pending.swap(c->queue);
+    }
+    bufs.clear();
+    for (auto &buf : pending)
+      bufs.push_back(buf.get());
+    if (!writeMessages(c->fd, bufs)) {
+      if (errno == EPIPE || errno == ECONNRESET)
+        LOG_S(INFO) << "client " << id << " hung up";
+      else
+        LOG_S(ERROR) << "failed to write to client " << id << ": "
+                     << strerror(errno);
+      c->close();
+      return;
+    }
+    pending.clear();
+  }
+}
+#endif
+} // namespace
+
 void launchStdout() {
   threadEnter();
   std::thread([]() {
     set_thread_name("stdout");
 
+    std::vector<OutMessage> messages;
+    std::vector<rapidjson::StringBuffer *> bufs;
     while (true) {
-      std::vector<std::string> messages = for_stdout->dequeueAll();
-      for (auto &s : messages) {
-        llvm::outs() << "Content-Length: " << s.size() << "\r\n\r\n" << s;
-        llvm::outs().flush();
+      messages = for_stdout->dequeueAll();
+      if (server_mode) {
+        routeMessages(messages);
+      } else {
+        bufs.clear();
+        for (auto &msg : messages)
+          bufs.push_back(msg.buf.get());
+        if (!writeMessages(1, bufs))
+          LOG_S(ERROR) << "failed to write to stdout: " << strerror(errno);
       }
+      releaseOutBuffers(messages);
       if (stdout_waiter->wait(g_quit, for_stdout))
         break;
     }
@@ -617,6 +960,198 @@ void launchStdout() {
   }).detach();
 }
 
+bool launchServer(const std::string &path) {
+#ifdef _WIN32
+  LOG_S(ERROR) << "daemon mode is not supported on Windows";
+  return false;
+#else
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path) {
+    LOG_S(ERROR) << "socket path is too long: " << path;
+    return false;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    LOG_S(ERROR) << "socket: " << strerror(errno);
+    return false;
+  }
+  ::unlink(path.c_str());
+  // Only the owner may connect.
+  mode_t old_mask = ::umask(0077);
+  int err = ::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr);
+  ::umask(old_mask);
+  if (err < 0 || ::listen(fd, 16) < 0) {
+    LOG_S(ERROR) << "failed to listen on " << path << ": " << strerror(errno);
+    ::close(fd);
+    return false;
+  }
+  LOG_S(INFO) << "listen on " << path;
+  server_mode = true;
+  // A client may disconnect before its synthesized "exit" is handled. Writes
+  // to it must fail with EPIPE instead of killing the daemon.
+  ::signal(SIGPIPE, SIG_IGN);
+
+  std::thread([fd]() {
+    set_thread_name("accept");
+    for (int next_id = 1;;) {
+      int cfd = ::accept(fd, nullptr, nullptr);
+      if (cfd < 0) {
+        if (errno != EINTR && errno != ECONNABORTED)
+          LOG_S(ERROR) << "accept: " << strerror(errno);
+        continue;
+      }
+      if (g_quit.load(std::memory_order_relaxed)) {
+        ::close(cfd);
+        continue;
+      }
+      int id = next_id++;
+      LOG_S(INFO) << "client " << id << " connected";
+      auto c = std::make_shared<Client>();
+      c->fd = cfd;
+      {
+        std::lock_guard lock(clients_mtx);
+        clients[id] = c;
+      }
+      threadEnter();
+      std::thread([c, id]() {
+        std::string name = "write" + std::to_string(id);
+        set_thread_name(name.c_str());
+        writeClient(c, id);
+        threadLeave();
+      }).detach();
+      threadEnter();
+      std::thread([cfd, id]() {
+        std::string name = "client" + std::to_string(id);
+        set_thread_name(name.c_str());
+        readMessages(cfd, id);
+        threadLeave();
+      }).detach();
+    }
+  }).detach();
+  return true;
+#endif
+}
+
+namespace {
+std::string documentPath(InMessage &msg) {
+  auto &d = *msg.document;
+  auto params = d.FindMember("params");
+  if (params == d.MemberEnd() || !params->value.IsObject())
+    return {};
+  auto doc = params->value.FindMember("textDocument");
+  if (doc == params->value.MemberEnd() || !doc->value.IsObject())
+    return {};
+  auto uri = doc->value.FindMember("uri");
+  if (uri == doc->value.MemberEnd() || !uri->value.IsString())
+    return {};
+  DocumentUri ret;
+  ret.raw_uri = uri->value.GetString();
+  return ret.getPath();
+}
+
+// Returns the parameters of |msg| other than the document and the position,
+// e.g. the startLine/endLine/all extensions of documentSymbol.
+std::string otherParams(InMessage &msg) {
+  auto &d = *msg.document;
+  auto params = d.FindMember("params");
+  if (params == d.MemberEnd() || !params->value.IsObject())
+    return {};
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> w(sb);
+  w.StartObject();
+  for (auto it = params->value.MemberBegin(); it != params->value.MemberEnd();
+       ++it) {
+    StringRef name(it->name.GetString(), it->name.GetStringLength());
+    if (name == "textDocument" || name == "position")
+      continue;
+    w.Key(name.data(), name.size());
+    it->value.Accept(w);
+  }
+  w.EndObject();
+  return sb.GetString();
+}
+
+// Rapid cursor movement produces bursts of position-dependent requests for
+// the same document. Only the latest one of each (client, method, document,
+// other parameters) in a batch is worth computing; the others get an empty
+// result.
+void dropSuperseded(std::vector<InMessage> &messages) {
+  static const StringSet<> methods{
+      "textDocument/codeLens", "textDocument/documentHighlight",
+      "textDocument/documentSymbol", "textDocument/hover"};
+  if (!g_config || !g_config->request.supersede || messages.size() < 2)
+    return;
+  std::set<std::tuple<int, std::string_view, std::string, std::string>> seen;
+  std::vector<bool> drop(messages.size());
+  for (size_t i = messages.size(); i--;) {
+    InMessage &msg = messages[i];
+    if (!msg.id.valid() || !methods.count(msg.method))
+      continue;
+    std::string path = documentPath(msg);
+    if (path.empty() || seen.emplace(msg.client, msg.method, std::move(path),
+                                     otherParams(msg))
+                            .second)
+      continue;
+    drop[i] = true;
+    LOG_V(2) << "drop superseded " << msg.method << " " << msg.id.value;
+    if (msg.method == "textDocument/hover")
+      reply(msg.id, [](JsonWriter &w) { w.null_(); });
+    else
+      reply(msg.id, [](JsonWriter &w) {
+        w.startArray();
+        w.endArray();
+      });
+  }
+  size_t j = 0;
+  for (size_t i = 0; i < messages.size(); i++)
+    if (!drop[i] && j++ != i)
+      messages[j - 1] = std::move(messages[i]);
+  messages.resize(j);
+}
+
+bool openedByOthers(int client, StringRef path) {
+  for (auto &[id, c] : clients)
+    if (id != client && c->open.count(path))
+      return true;
+  return false;
+}
+
+// In daemon mode, the DB, the project and the working files are shared by all
+// clients. A document is only closed when the last client that opened it
+// closes it or disconnects. Returns false if |msg| has been consumed.
+bool filterClientMessage(MessageHandler &handler, InMessage &msg) {
+  std::lock_guard lock(clients_mtx);
+  auto it = clients.find(msg.client);
+  if (it == clients.end())
+    return false;
+  Client &c = *it->second;
+  if (msg.method == "exit") {
+    for (auto &e : c.open)
+      if (!openedByOthers(msg.client, e.getKey())) {
+        std::string path = e.getKey().str();
+        handler.wfiles->onClose(path);
+        handler.manager->onClose(path);
+        clearSemanticHighlight(path);
+        removeCache(path);
+      }
+    c.close();
+    clients.erase(it);
+    LOG_S(INFO) << "client " << msg.client << " disconnected";
+    return false;
+  }
+  if (msg.method == "textDocument/didOpen") {
+    c.open.insert(documentPath(msg));
+  } else if (msg.method == "textDocument/didClose") {
+    std::string path = documentPath(msg);
+    c.open.erase(path);
+    return !openedByOthers(msg.client, path);
+  }
+  return true;
+}
+} // namespace
+
 void mainLoop() {
   Project project;
   WorkingFiles wfiles;
@@ -657,6 +1192,15 @@ void mainLoop() {
   std::deque<InMessage> backlog;
   StringMap<std::deque<InMessage *>> path2backlog;
   while (true) {
+    // Drop cancelled requests waiting for their files to be indexed.
+    if (num_cancelled.load(std::memory_order_relaxed))
+      for (InMessage &message : backlog)
+        if (message.backlog_path.size() && isCancelled(message.id)) {
+          auto &q = path2backlog[message.backlog_path];
+          q.erase(std::find(q.begin(), q.end(), &message));
+          message.backlog_path.clear();
+          replyCancelled(message.id);
+        }
     if (backlog.size()) {
       auto now = chrono::steady_clock::now();
       handler.overdue = true;
@@ -664,17 +1208,27 @@ void mainLoop() {
         if (backlog[0].backlog_path.size()) {
           if (now < backlog[0].deadline)
             break;
+          cur_client = backlog[0].client;
           handler.run(backlog[0]);
           path2backlog[backlog[0].backlog_path].pop_front();
         }
         backlog.pop_front();
       }
       handler.overdue = false;
+      cur_client = -1;
     }
 
     std::vector<InMessage> messages = on_request->dequeueAll();
+    dropSuperseded(messages);
     bool did_work = messages.size();
-    for (InMessage &message : messages)
+    for (InMessage &message : messages) {
+      if (server_mode && !filterClientMessage(handler, message))
+        continue;
+      if (isCancelled(message.id)) {
+        replyCancelled(message.id);
+        continue;
+      }
+      cur_client = message.client;
       try {
         handler.run(message);
       } catch (NotIndexed &ex) {
@@ -682,6 +1236,8 @@ void mainLoop() {
         backlog.back().backlog_path = ex.path;
         path2backlog[ex.path].push_back(&backlog.back());
       }
+    }
+    cur_client = -1;
 
     bool indexed = false;
     for (int i = 20; i--;) {
@@ -695,9 +1251,11 @@ void mainLoop() {
         auto it = path2backlog.find(update->files_def_update->first.path);
         if (it != path2backlog.end()) {
           for (auto &message : it->second) {
+            cur_client = message->client;
             handler.run(*message);
             message->backlog_path.clear();
           }
+          cur_client = -1;
           path2backlog.erase(it);
         }
       }
@@ -751,9 +1309,10 @@ void mainLoop() {
         freeUnusedMemory();
         has_indexed = false;
       }
-      if (backlog.empty())
+      if (backlog.empty()) {
+        clearCancelled();
         main_waiter->wait(g_quit, on_indexed, on_request);
-      else
+      } else
         main_waiter->waitUntil(backlog[0].deadline, on_indexed, on_request);
     }
   }
@@ -830,9 +1389,10 @@ std::optional<std::string> loadIndexedContent(const std::string &path) {
 }
 
 void notifyOrRequest(const char *method, bool request,
-                     const std::function<void(JsonWriter &)> &fn) {
-  rapidjson::StringBuffer output;
-  rapidjson::Writer<rapidjson::StringBuffer> w(output);
+                     const std::function<void(JsonWriter &)> &fn,
+                     bool broadcast) {
+  auto output = acquireOutBuffer();
+  rapidjson::Writer<rapidjson::StringBuffer> w(*output);
   w.StartObject();
   w.Key("jsonrpc");
   w.String("2.0");
@@ -848,13 +1408,13 @@ void notifyOrRequest(const char *method, bool request,
   w.EndObject();
   LOG_V(2) << (request ? "RequestMessage: " : "NotificationMessage: ")
            << method;
-  for_stdout->pushBack(output.GetString());
+  for_stdout->pushBack({broadcast ? -1 : cur_client, std::move(output)});
 }
 
 static void reply(const RequestId &id, const char *key,
                   const std::function<void(JsonWriter &)> &fn) {
-  rapidjson::StringBuffer output;
-  rapidjson::Writer<rapidjson::StringBuffer> w(output);
+  auto output = acquireOutBuffer();
+  rapidjson::Writer<rapidjson::StringBuffer> w(*output);
   w.StartObject();
   w.Key("jsonrpc");
   w.String("2.0");
@@ -876,7 +1436,14 @@ static void reply(const RequestId &id, const char *key,
   w.EndObject();
   if (id.valid())
     LOG_V(2) << "respond to RequestMessage: " << id.value;
-  for_stdout->pushBack(output.GetString());
+  for_stdout->pushBack({id.client, std::move(output)});
+}
+
+bool isCancelled(const RequestId &id) {
+  if (!id.valid() || !num_cancelled.load(std::memory_order_relaxed))
+    return false;
+  std::lock_guard lock(cancelled_mtx);
+  return cancelled.count({id.client, id.value});
 }
 
 void reply(const RequestId &id, const std::function<void(JsonWriter &)> &fn) {
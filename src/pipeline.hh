@@ -54,6 +54,7 @@ void threadLeave();
 void init();
 void launchStdin();
 void launchStdout();
+bool launchServer(const std::string &path);
 void indexer_Main(SemaManager *manager, VFS *vfs, Project *project,
                   WorkingFiles *wfiles);
 void mainLoop();
@@ -64,15 +65,24 @@ void index(const std::string &path, const std::vector<const char *> &args,
 void removeCache(const std::string &path);
 std::optional<std::string> loadIndexedContent(const std::string &path);
 
+// In daemon mode, a message is sent to the client whose message is being
+// handled, if any, or to every client if |broadcast| is set.
 void notifyOrRequest(const char *method, bool request,
-                     const std::function<void(JsonWriter &)> &fn);
+                     const std::function<void(JsonWriter &)> &fn,
+                     bool broadcast = false);
 template <typename T> void notify(const char *method, T &result) {
   notifyOrRequest(method, false, [&](JsonWriter &w) { reflect(w, result); });
 }
+template <typename T> void broadcast(const char *method, T &result) {
+  notifyOrRequest(
+      method, false, [&](JsonWriter &w) { reflect(w, result); }, true);
+}
 template <typename T> void request(const char *method, T &result) {
   notifyOrRequest(method, true, [&](JsonWriter &w) { reflect(w, result); });
 }
 
+// Whether the client has sent $/cancelRequest for |id|.
+bool isCancelled(const RequestId &id);
 void reply(const RequestId &id, const std::function<void(JsonWriter &)> &fn);
 
 void replyError(const RequestId &id,
@@ -8,6 +8,8 @@
 #include "log.hh"
 #include "pipeline.hh"
 #include "platform.hh"
+#include "serializer.hh"
+#include "threaded_queue.hh"
 #include "utils.hh"
 #include "working_files.hh"
 
@@ -16,12 +18,17 @@
 #include <clang/Driver/Types.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Tooling/CompilationDatabase.h>
+#include <clang/Tooling/Tooling.h>
 #include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/StringSet.h>
+#include <llvm/Support/CommandLine.h>
 #include <llvm/Support/GlobPattern.h>
 #include <llvm/Support/LineIterator.h>
 #include <llvm/Support/Program.h>
+#include <llvm/Support/StringSaver.h>
 
+#include <rapidjson/filereadstream.h>
+#include <rapidjson/reader.h>
 #include <rapidjson/writer.h>
 
 #ifdef _WIN32
@@ -30,9 +37,14 @@
 #include <unistd.h>
 #endif
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <filesystem>
+#include <functional>
 #include <limits.h>
+#include <string.h>
+#include <thread>
 #include <unordered_set>
 #include <vector>
 
@@ -70,22 +82,36 @@ enum OptionClass {
   Separate,
 };
 
-struct ProjectProcessor {
-  Project::Folder &folder;
-  std::unordered_set<size_t> command_set;
-  StringSet<> exclude_args;
-  std::vector<GlobPattern> exclude_globs;
+// Matches arguments against exact strings and glob patterns.
+struct ArgMatcher {
+  StringSet<> args;
+  std::vector<GlobPattern> globs;
 
-  ProjectProcessor(Project::Folder &folder) : folder(folder) {
-    for (auto &arg : g_config->clang.excludeArgs)
+  ArgMatcher(const std::vector<std::string> &patterns) {
+    for (auto &arg : patterns)
       if (arg.find_first_of("?*[") == std::string::npos)
-        exclude_args.insert(arg);
+        args.insert(arg);
       else if (Expected<GlobPattern> glob_or_err = GlobPattern::create(arg))
-        exclude_globs.push_back(std::move(*glob_or_err));
+        globs.push_back(std::move(*glob_or_err));
       else
         LOG_S(WARNING) << toString(glob_or_err.takeError());
   }
 
+  bool matches(StringRef arg) const {
+    return args.count(arg) || any_of(globs, [&](const GlobPattern &glob) {
+             return glob.match(arg);
+           });
+  }
+};
+
+struct ProjectProcessor {
+  Project::Folder &folder;
+  std::unordered_set<size_t> command_set;
+  ArgMatcher exclude;
+
+  ProjectProcessor(Project::Folder &folder)
+      : folder(folder), exclude(g_config->clang.excludeArgs) {}
+
   bool excludesArg(StringRef arg, int &i) {
     if (arg.startswith("-M")) {
       if (arg == "-MF" || arg == "-MT" || arg == "-MQ")
@@ -97,10 +123,7 @@ struct ProjectProcessor {
       return true;
     }
 
-    bool const ret = (exclude_args.count(arg) ||
-                      any_of(exclude_globs, [&](const GlobPattern &glob) {
-                        return glob.match(arg);
-                      }));
+    bool const ret = exclude.matches(arg);
     return g_config->clang.excludeArgsIsWhitelist ? !ret : ret;
   }
 
@@ -314,6 +337,61 @@ void loadDirectoryListing(ProjectProcessor &proc, const std::string &root,
     }
 }
 
+// Calls |fn| with the ancestor directories (with a trailing slash) of |path|
+// under |root|, deepest first, until it returns true.
+template <typename Fn> void walkUp(StringRef path, StringRef root, Fn fn) {
+  for (size_t i = path.size(); i > root.size();) {
+    i = path.rfind('/', i - 1);
+    if (i == StringRef::npos || i + 1 < root.size() ||
+        fn(path.substr(0, i + 1)))
+      break;
+  }
+}
+
+// Builds Folder::dir2candidates and Folder::stem2entries from the
+// compile_commands.json entries.
+void buildCandidates(const std::string &root, Project::Folder &folder) {
+  const size_t kPerLanguage = 4;
+  // (distance, entry index) for each LanguageId + 1.
+  std::unordered_map<std::string, std::array<std::vector<std::pair<int, int>>,
+                                             int(LanguageId::Cuda) + 2>>
+      dir2nearest;
+  folder.stem2entries.clear();
+  auto add = [&](StringRef dir, int lang, int dist, int i) {
+    auto &nearest = dir2nearest[dir.str()][lang];
+    if (nearest.size() < kPerLanguage) {
+      nearest.emplace_back(dist, i);
+    } else {
+      auto it = std::max_element(nearest.begin(), nearest.end());
+      if (dist < it->first)
+        *it = {dist, i};
+    }
+  };
+  for (int i = 0; i < folder.entries.size(); i++) {
+    const Project::Entry &e = folder.entries[i];
+    if (!e.compdb_size)
+      continue;
+    folder.stem2entries[sys::path::stem(e.filename).str()].push_back(i);
+    int lang = int(lookupExtension(e.filename).first) + 1, dist = 0;
+    if (!StringRef(e.filename).startswith(root))
+      add(root, lang, INT_MAX, i);
+    else
+      walkUp(e.filename, root, [&](StringRef dir) {
+        add(dir, lang, dist++, i);
+        return false;
+      });
+  }
+
+  folder.dir2candidates.clear();
+  for (auto &it : dir2nearest) {
+    std::vector<int> &candidates = folder.dir2candidates[it.first];
+    for (auto &nearest : it.second)
+      for (auto &[_, i] : nearest)
+        candidates.push_back(i);
+    std::sort(candidates.begin(), candidates.end());
+  }
+}
+
 // Computes a score based on how well |a| and |b| match. This is used for
 // argument guessing.
 int computeGuessScore(std::string_view a, std::string_view b) {
@@ -357,7 +435,9 @@ int computeGuessScore(std::string_view a, std::string_view b) {
 void checkPath(std::string const &arg) {
   if (arg[0] == '.')
     return;
+  static std::mutex mutex;
   static std::unordered_map<std::string, int> pathList;
+  std::lock_guard lock(mutex);
   auto pathListPair = pathList.insert({arg, 0});
   if (pathListPair.second) {
     if (!std::filesystem::exists(std::filesystem::path(arg))) {
@@ -365,6 +445,418 @@ void checkPath(std::string const &arg) {
     }
   }
 }
+
+// Memoizes realPath of directories. compile_commands.json entries share few
+// directories, so resolving a file usually costs an lstat.
+struct RealPathCache {
+  std::mutex mutex;
+  std::unordered_map<std::string, std::string> dirs;
+
+  std::string dir(const std::string &path) {
+    {
+      std::lock_guard lock(mutex);
+      auto it = dirs.find(path);
+      if (it != dirs.end())
+        return it->second;
+    }
+    std::string real = realPath(path);
+    std::lock_guard lock(mutex);
+    return dirs.try_emplace(path, std::move(real)).first->second;
+  }
+
+  std::string file(const std::string &path) {
+    StringRef parent = sys::path::parent_path(path);
+    if (parent.empty())
+      return realPath(path);
+    std::string ret = dir(parent.str());
+    if (ret.empty() || ret.back() != '/')
+      ret += '/';
+    ret += sys::path::filename(path);
+    return sys::fs::is_symlink_file(ret) ? realPath(ret) : ret;
+  }
+};
+
+// |mapped_root| is |root| after doPathMapping. Relative directories are
+// resolved against |root| and then mapped.
+Project::Entry makeEntry(ProjectProcessor &proc, RealPathCache &real,
+                         const std::string &root,
+                         const std::string &mapped_root, StringRef directory,
+                         StringRef filename, std::vector<std::string> args) {
+  Project::Entry entry;
+  if (args.empty() || filename.empty())
+    return entry;
+  entry.root = mapped_root;
+
+  // If workspace folder is real/ but entries use symlink/, convert to real/.
+  entry.directory = real.dir(resolveIfRelative(root, directory.str()));
+  entry.directory.push_back('/');
+  normalizeFolder(entry.directory);
+  entry.directory.pop_back();
+  doPathMapping(entry.directory);
+  entry.filename =
+      real.file(resolveIfRelative(entry.directory, filename.str()));
+  normalizeFolder(entry.filename);
+  doPathMapping(entry.filename);
+
+  checkPath(entry.root);
+  checkPath(entry.directory);
+  checkPath(entry.filename);
+
+  // Like tooling::inferTargetAndDriverMode, e.g. add --target=arm-linux-gnueabi
+  // for arm-linux-gnueabi-g++ and --driver-mode=cl for clang-cl.
+  tooling::addTargetAndModeForProgramName(args, args[0]);
+  entry.args.reserve(args.size());
+  entry.args.push_back(intern(args[0])); // First is skipped
+
+  for (int i = 1; i < args.size() - 1; i++) {
+    doPathMapping(args[i]);
+    if (!proc.excludesArg(args[i], i))
+      entry.args.push_back(intern(args[i]));
+  }
+
+  entry.args.push_back(intern(entry.filename));
+  entry.compdb_size = entry.args.size();
+  return entry;
+}
+
+// A compile_commands.json entry.
+struct CompdbCommand {
+  std::string directory, file, command;
+  std::vector<std::string> arguments;
+};
+
+// Consecutive entries processed by one worker into |out|. A null |out| tells
+// the worker to exit.
+struct CompdbBatch {
+  std::vector<CompdbCommand> commands;
+  std::vector<Project::Entry> *out = nullptr;
+};
+
+// SAX handler for compile_commands.json. This avoids materializing a document
+// tree for large databases. Every |batch_size| entries are handed to |queue|
+// while the rest of the file is still being parsed.
+struct CompdbHandler
+    : rapidjson::BaseReaderHandler<rapidjson::UTF8<>, CompdbHandler> {
+  static constexpr size_t batch_size = 256;
+  ThreadedQueue<CompdbBatch> &queue;
+  std::function<void()> on_batch;
+  // Stable as workers write to them while batches are appended.
+  std::deque<std::vector<Project::Entry>> results;
+  std::vector<CompdbCommand> batch;
+  std::string key;
+  int depth = 0;
+
+  CompdbHandler(ThreadedQueue<CompdbBatch> &queue,
+                std::function<void()> on_batch)
+      : queue(queue), on_batch(std::move(on_batch)) {}
+
+  void flush() {
+    if (batch.empty())
+      return;
+    results.emplace_back();
+    queue.pushBack({std::move(batch), &results.back()});
+    batch.clear();
+    on_batch();
+  }
+
+  bool StartObject() {
+    if (depth == 1)
+      batch.emplace_back();
+    return ++depth > 1;
+  }
+  bool EndObject(rapidjson::SizeType) {
+    if (--depth == 1 && batch.size() == batch_size)
+      flush();
+    return true;
+  }
+  bool StartArray() { return ++depth != 2; }
+  bool EndArray(rapidjson::SizeType) {
+    depth--;
+    return true;
+  }
+  bool Key(const char *str, rapidjson::SizeType len, bool) {
+    if (depth == 2)
+      key.assign(str, len);
+    return true;
+  }
+  bool String(const char *str, rapidjson::SizeType len, bool) {
+    if (depth == 2) {
+      if (key == "directory")
+        batch.back().directory.assign(str, len);
+      else if (key == "file")
+        batch.back().file.assign(str, len);
+      else if (key == "command")
+        batch.back().command.assign(str, len);
+    } else if (depth == 3 && key == "arguments") {
+      batch.back().arguments.emplace_back(str, len);
+    }
+    return true;
+  }
+};
+
+// Loads compile_commands.json at |path| into |entries|. The file is parsed in
+// chunks and full batches of entries are processed by worker threads while
+// parsing continues. Returns false if the file cannot be read or parsed, or if
+// it uses response files.
+bool loadCompdb(ProjectProcessor &proc, const std::string &root,
+                const std::string &path, std::vector<Project::Entry> &entries) {
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (!fp)
+    return false;
+  RealPathCache real;
+  std::string mapped_root = root;
+  doPathMapping(mapped_root);
+  std::atomic<bool> response_file{false};
+  ThreadedQueue<CompdbBatch> queue;
+  auto work = [&]() {
+    while (true) {
+      CompdbBatch b = queue.dequeue();
+      if (!b.out)
+        break;
+      b.out->reserve(b.commands.size());
+      for (CompdbCommand &cmd : b.commands) {
+        std::vector<std::string> args;
+        if (cmd.arguments.size()) {
+          args = std::move(cmd.arguments);
+        } else {
+          BumpPtrAllocator alloc;
+          StringSaver saver(alloc);
+          SmallVector<const char *, 0> argv;
+#ifdef _WIN32
+          cl::TokenizeWindowsCommandLine(cmd.command, saver, argv);
+#else
+          cl::TokenizeGNUCommandLine(cmd.command, saver, argv);
+#endif
+          args.assign(argv.begin(), argv.end());
+        }
+        for (auto &arg : args)
+          if (arg[0] == '@')
+            response_file = true;
+        b.out->push_back(makeEntry(proc, real, root, mapped_root,
+                                   cmd.directory, cmd.file, std::move(args)));
+      }
+    }
+  };
+  // Spawn a worker for each full batch, leaving one core to the parser.
+  size_t max_threads =
+      std::max<size_t>(std::thread::hardware_concurrency(), 2) - 1;
+  std::vector<std::thread> threads;
+  CompdbHandler handler(queue, [&]() {
+    if (threads.size() < max_threads && queue.size() > 0)
+      threads.emplace_back(work);
+  });
+  rapidjson::Reader reader;
+  char buf[1 << 16];
+  rapidjson::FileReadStream stream(fp, buf, sizeof buf);
+  bool ok = !reader.Parse(stream, handler).IsError();
+  fclose(fp);
+  if (ok)
+    handler.flush();
+  // The parser thread joins the workers on the remaining batches.
+  for (size_t i = 0; i <= threads.size(); i++)
+    queue.pushBack({});
+  work();
+  for (auto &thread : threads)
+    thread.join();
+  if (!ok || response_file)
+    return false;
+  size_t n = 0;
+  for (auto &result : handler.results)
+    n += result.size();
+  entries.reserve(n);
+  for (auto &result : handler.results)
+    std::move(result.begin(), result.end(), std::back_inserter(entries));
+  return true;
+}
+} // namespace
+
+// cache.ignoreArgs, rebuilt by Project::load so that it follows the config.
+static std::mutex ignore_args_mutex;
+static std::shared_ptr<const ArgMatcher> ignore_args;
+
+namespace {
+// Returns the stem of the main source file in |args|. For inferred entries,
+// it is not that of |path|.
+StringRef mainStem(const std::vector<const char *> &args, StringRef path) {
+  for (size_t i = args.size(); i-- > 1;)
+    if (args[i][0] != '-') {
+      auto [lang, header] = lookupExtension(args[i]);
+      if (lang != LanguageId::Unknown && !header)
+        return sys::path::stem(args[i]);
+    }
+  return sys::path::stem(path);
+}
+
+// Folds |arg| into |hash| for argsFingerprint. |skip| is set after an ignored
+// -o so that the output file is left out as well.
+void hashArg(uint64_t &hash, StringRef arg, StringRef stem,
+             const ArgMatcher *ignore, bool &skip) {
+  if (skip || (ignore && ignore->matches(arg))) {
+    skip = !skip && arg == "-o";
+    return;
+  }
+  bool abstracted = sys::path::stem(arg) == stem;
+  uint64_t h = hashUsr(abstracted ? "\1" : arg);
+  hash ^= h + 0x9e3779b97f4a7c15 + (hash << 6) + (hash >> 2);
+}
+
+// Moves the arguments of the entries into ArgSets shared by those with the
+// same arguments apart from the ones named after the main source file.
+void internArgs(Project::Folder &folder) {
+  std::shared_ptr<const ArgMatcher> ignore;
+  {
+    std::lock_guard lock(ignore_args_mutex);
+    ignore = ignore_args;
+  }
+  std::unordered_map<std::string, std::shared_ptr<const Project::ArgSet>>
+      sets;
+  for (Project::Entry &e : folder.entries) {
+    StringRef stem = mainStem(e.args, e.filename);
+    std::vector<const char *> args, file_args;
+    uint64_t hash = 0;
+    bool skip = false;
+    args.reserve(e.args.size());
+    for (const char *arg : e.args) {
+      hashArg(hash, arg, stem, ignore.get(), skip);
+      if (sys::path::stem(arg) == stem) {
+        args.push_back(nullptr);
+        file_args.push_back(arg);
+      } else {
+        args.push_back(arg);
+      }
+    }
+    // argsFingerprint resumes after the set with skip == false.
+    if (skip)
+      continue;
+    // Arguments are interned, so pointers identify them.
+    std::string key(reinterpret_cast<const char *>(args.data()),
+                    args.size() * sizeof(const char *));
+    auto &set = sets[key];
+    if (!set)
+      set = std::make_shared<const Project::ArgSet>(
+          Project::ArgSet{std::move(args), hash});
+    e.arg_set = set;
+    e.file_args = std::move(file_args);
+    std::vector<const char *>().swap(e.args);
+  }
+}
+} // namespace
+
+std::vector<const char *> Project::Entry::expandArgs() const {
+  if (!arg_set)
+    return args;
+  std::vector<const char *> ret = arg_set->args;
+  auto it = file_args.begin();
+  for (const char *&arg : ret)
+    if (!arg)
+      arg = *it++;
+  return ret;
+}
+
+uint64_t argsFingerprint(const Project::Entry &entry,
+                         const std::string &path) {
+  std::shared_ptr<const ArgMatcher> ignore;
+  {
+    std::lock_guard lock(ignore_args_mutex);
+    ignore = ignore_args;
+  }
+  const std::vector<const char *> &args = entry.args;
+  StringRef stem = mainStem(args, path);
+  uint64_t hash = 0;
+  size_t i = 0;
+  // If |args| start with the arguments of entry.arg_set, with the file
+  // arguments abstracted out in the same way, resume from its hash.
+  if (const Project::ArgSet *set = entry.arg_set.get();
+      set && set->args.size() <= args.size() && entry.file_args.size() &&
+      all_of(entry.file_args,
+             [&](const char *arg) { return sys::path::stem(arg) == stem; })) {
+    auto it = entry.file_args.begin();
+    for (; i < set->args.size(); i++)
+      if (args[i] != (set->args[i] ? set->args[i] : *it++))
+        break;
+    if (i == set->args.size())
+      hash = set->hash;
+    else
+      i = 0;
+  }
+  bool skip = false;
+  for (; i < args.size(); i++)
+    hashArg(hash, args[i], stem, ignore.get(), skip);
+  return hash;
+}
+
+REFLECT_STRUCT(Project::Entry, root, directory, filename, args, compdb_size);
+
+namespace {
+std::string projectCachePath(const std::string &root) {
+  return g_config->cache.directory + "@project/" +
+         escapeFileName(root.substr(0, root.size() - 1)) + ".blob";
+}
+
+// Returns the key of the processed entries of the compdb at |path|, or "" if
+// they should not be cached. It covers the compdb (its mtime and size, or its
+// content if generated by compilationDatabaseCommand) and the options that
+// affect processing.
+std::string projectCacheStamp(const std::string &root,
+                              const std::string &path) {
+  if (g_config->cache.directory.empty() ||
+      sys::fs::exists(root + ".ccls")) // Directory listing is not cached.
+    return {};
+  std::string stamp = "2 ";
+  if (g_config->compilationDatabaseCommand.empty()) {
+    sys::fs::file_status status;
+    if (sys::fs::status(path, status))
+      return {};
+    stamp += path + ' ' + std::to_string(status.getSize()) + ' ' +
+             std::to_string(
+                 status.getLastModificationTime().time_since_epoch().count());
+  } else {
+    // |path| is a temporary file. Key by the content.
+    std::optional<std::string> content = readContent(path);
+    if (!content)
+      return {};
+    stamp += g_config->compilationDatabaseCommand + ' ' +
+             std::to_string(hashUsr(*content));
+  }
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  JsonWriter json_writer(&writer);
+  json_writer.startArray();
+  reflect(json_writer, g_config->clang);
+  reflect(json_writer, g_config->workspaceFolders);
+  json_writer.endArray();
+  stamp += ' ';
+  stamp += sb.GetString();
+  return stamp;
+}
+
+bool readProjectCache(const std::string &root, const std::string &stamp,
+                      Project::Folder &folder) {
+  std::optional<std::string> content = readContent(projectCachePath(root));
+  if (!content || content->compare(0, stamp.size() + 1,
+                                   stamp.c_str(), stamp.size() + 1))
+    return false;
+  BinaryReader reader(std::string_view(*content).substr(stamp.size() + 1));
+  std::vector<std::pair<std::string, int>> search_dirs;
+  reflect(reader, folder.entries);
+  reflect(reader, search_dirs);
+  folder.search_dir2kind.insert(search_dirs.begin(), search_dirs.end());
+  return true;
+}
+
+void writeProjectCache(const std::string &root, const std::string &stamp,
+                       Project::Folder &folder) {
+  BinaryWriter writer;
+  std::vector<std::pair<std::string, int>> search_dirs(
+      folder.search_dir2kind.begin(), folder.search_dir2kind.end());
+  writer.string(stamp.c_str(), stamp.size());
+  reflect(writer, folder.entries);
+  reflect(writer, search_dirs);
+  std::string path = projectCachePath(root), tmp = path + ".tmp";
+  sys::fs::create_directories(sys::path::parent_path(path));
+  writeToFile(tmp, writer.take());
+  sys::fs::rename(tmp, path);
+}
 } // namespace
 
 void Project::loadDirectory(const std::string &root, Project::Folder &folder) {
@@ -421,8 +913,28 @@ void Project::loadDirectory(const std::string &root, Project::Folder &folder) {
     }
   }
 
-  std::unique_ptr<tooling::CompilationDatabase> cdb =
-      tooling::CompilationDatabase::loadFromDirectory(cdbDir, err_msg);
+  std::string stamp = projectCacheStamp(root, path.str().str());
+  std::vector<Project::Entry> entries;
+  ProjectProcessor proc(folder);
+  bool from_cache = stamp.size() && readProjectCache(root, stamp, folder);
+  bool ok = from_cache || loadCompdb(proc, root, path.str().str(), entries);
+  if (!ok) {
+    // Response files are expanded by the tooling loader. Do not cache the
+    // result as the stamp does not cover them.
+    stamp.clear();
+    std::unique_ptr<tooling::CompilationDatabase> cdb =
+        tooling::CompilationDatabase::loadFromDirectory(cdbDir, err_msg);
+    if (cdb) {
+      RealPathCache real;
+      std::string mapped_root = root;
+      doPathMapping(mapped_root);
+      for (tooling::CompileCommand &cmd : cdb->getAllCompileCommands())
+        entries.push_back(makeEntry(proc, real, root, mapped_root,
+                                    cmd.Directory, cmd.Filename,
+                                    std::move(cmd.CommandLine)));
+      ok = true;
+    }
+  }
   if (!g_config->compilationDatabaseCommand.empty()) {
 #ifdef _WIN32
     DeleteFileA(stdinPath.c_str());
@@ -435,51 +947,22 @@ void Project::loadDirectory(const std::string &root, Project::Folder &folder) {
 #endif
   }
 
-  ProjectProcessor proc(folder);
   StringSet<> seen;
-  std::vector<Project::Entry> result;
-  if (!cdb) {
+  if (!ok) {
     if (g_config->compilationDatabaseCommand.size() || sys::fs::exists(path))
       LOG_S(ERROR) << "failed to load " << path.c_str();
+  } else if (from_cache) {
+    LOG_S(INFO) << "loaded " << path.c_str() << " from cache";
   } else {
     LOG_S(INFO) << "loaded " << path.c_str();
-    for (tooling::CompileCommand &cmd : cdb->getAllCompileCommands()) {
-      Project::Entry entry;
-      entry.root = root;
-      doPathMapping(entry.root);
-
-      // If workspace folder is real/ but entries use symlink/, convert to
-      // real/.
-      entry.directory = realPath(resolveIfRelative(root, cmd.Directory));
-      entry.directory.push_back('/');
-      normalizeFolder(entry.directory);
-      entry.directory.pop_back();
-      doPathMapping(entry.directory);
-      entry.filename =
-          realPath(resolveIfRelative(entry.directory, cmd.Filename));
-      normalizeFolder(entry.filename);
-      doPathMapping(entry.filename);
-
-      checkPath(entry.root);
-      checkPath(entry.directory);
-      checkPath(entry.filename);
-
-      std::vector<std::string> args = std::move(cmd.CommandLine);
-      entry.args.reserve(args.size());
-      entry.args.push_back(intern(args[0])); // First is skipped
-
-      for (int i = 1; i < args.size() - 1; i++) {
-        doPathMapping(args[i]);
-        if (!proc.excludesArg(args[i], i))
-          entry.args.push_back(intern(args[i]));
-      }
-
-      entry.args.push_back(intern(entry.filename));
-      entry.compdb_size = entry.args.size();
+    for (Project::Entry &entry : entries) {
+      if (entry.filename.empty() || !seen.insert(entry.filename).second)
+        continue;
       proc.getSearchDirs(entry);
-      if (seen.insert(entry.filename).second)
-        folder.entries.push_back(entry);
+      folder.entries.push_back(std::move(entry));
     }
+    if (stamp.size())
+      writeProjectCache(root, stamp, folder);
   }
 
   // Use directory listing if .ccls exists or compile_commands.json does not
@@ -492,10 +975,16 @@ void Project::loadDirectory(const std::string &root, Project::Folder &folder) {
 
 void Project::load(const std::string &root) {
   assert(root.back() == '/');
-  std::lock_guard lock(mtx);
-  Folder &folder = root2folder[root];
-
+  // Load without holding mtx so that findEntry is not blocked meanwhile.
+  Folder folder;
   loadDirectory(root, folder);
+  {
+    auto ignore =
+        std::make_shared<const ArgMatcher>(g_config->cache.ignoreArgs);
+    std::lock_guard lock(ignore_args_mutex);
+    ignore_args = std::move(ignore);
+  }
+  internArgs(folder);
   for (auto &[path, kind] : folder.search_dir2kind)
     LOG_S(INFO) << "search directory: " << path << ' ' << " \"< "[kind];
 
@@ -505,6 +994,9 @@ void Project::load(const std::string &root) {
     folder.entries[i].id = i;
     folder.path2entry_index[folder.entries[i].filename] = i;
   }
+  buildCandidates(root, folder);
+  std::lock_guard lock(mtx);
+  root2folder[root] = std::move(folder);
 }
 
 Project::Entry Project::findEntry(const std::string &path, bool can_redirect,
@@ -524,14 +1016,20 @@ Project::Entry Project::findEntry(const std::string &path, bool can_redirect,
   for (auto &[root, folder] : root2folder)
     if (StringRef(path).startswith(root)) {
       // Find the best-fit .ccls
-      for (auto &[dir, args] : folder.dot_ccls)
-        if (StringRef(path).startswith(dir) &&
-            dir.length() > best_dot_ccls_dir.length()) {
-          best_dot_ccls_root = root;
-          best_dot_ccls_folder = &folder;
-          best_dot_ccls_dir = dir;
-          best_dot_ccls_args = &args;
-        }
+      Project::Folder *f = &folder;
+      const std::string *r = &root;
+      walkUp(path, root, [&](StringRef dir) {
+        if (dir.size() <= best_dot_ccls_dir.size())
+          return true;
+        auto it = f->dot_ccls.find(dir.str());
+        if (it == f->dot_ccls.end())
+          return false;
+        best_dot_ccls_root = *r;
+        best_dot_ccls_folder = f;
+        best_dot_ccls_dir = it->first;
+        best_dot_ccls_args = &it->second;
+        return true;
+      });
 
       if (!match) {
         auto it = folder.path2entry_index.find(path);
@@ -567,17 +1065,23 @@ Project::Entry Project::findEntry(const std::string &path, bool can_redirect,
     if (must_exist && !match && !(best_dot_ccls_args && !append))
       return ret;
     if (!best) {
-      // Infer args from a similar path.
+      // Infer args from a similar path among the entries with the same stem
+      // and the candidates of the nearest ancestor directory with
+      // compile_commands.json entries.
       int best_score = INT_MIN;
-      auto [lang, header] = lookupExtension(path);
-      for (auto &[root, folder] : root2folder)
-        if (StringRef(path).startswith(root))
-          for (const Entry &e : folder.entries)
-            if (e.compdb_size) {
+      std::pair<LanguageId, bool> lang = lookupExtension(path);
+      std::string stem = sys::path::stem(path).str();
+      for (auto &it : root2folder)
+        if (StringRef(path).startswith(it.first)) {
+          Project::Folder &folder = it.second;
+          auto consider = [&](const std::vector<int> &candidates) {
+            for (int i : candidates) {
+              const Entry &e = folder.entries[i];
               int score = computeGuessScore(path, e.filename);
               // Decrease score if .c is matched against .hh
-              auto [lang1, header1] = lookupExtension(e.filename);
-              if (lang != lang1 && !(lang == LanguageId::C && header))
+              LanguageId lang1 = lookupExtension(e.filename).first;
+              if (lang.first != lang1 &&
+                  !(lang.first == LanguageId::C && lang.second))
                 score -= 30;
               if (score > best_score) {
                 best_score = score;
@@ -585,6 +1089,18 @@ Project::Entry Project::findEntry(const std::string &path, bool can_redirect,
                 best = &e;
               }
             }
+          };
+          auto stem_it = folder.stem2entries.find(stem);
+          if (stem_it != folder.stem2entries.end())
+            consider(stem_it->second);
+          walkUp(path, it.first, [&](StringRef dir) {
+            auto it1 = folder.dir2candidates.find(dir.str());
+            if (it1 == folder.dir2candidates.end())
+              return false;
+            consider(it1->second);
+            return true;
+          });
+        }
       ret.is_inferred = true;
     }
     if (!best) {
@@ -596,12 +1112,16 @@ Project::Entry Project::findEntry(const std::string &path, bool can_redirect,
       // separately.
       ret.root = best->root;
       ret.directory = best->directory;
-      ret.args = best->args;
+      ret.args = best->expandArgs();
       ret.compdb_size = best->compdb_size;
       if (best->compdb_size) // delete trailing .ccls options if exist
         ret.args.resize(best->compdb_size);
       else
         best_dot_ccls_args = nullptr;
+      if (best->arg_set && best->arg_set->args.size() <= ret.args.size()) {
+        ret.arg_set = best->arg_set;
+        ret.file_args = best->file_args;
+      }
     }
     ret.filename = path;
   }
@@ -635,7 +1155,7 @@ void Project::index(WorkingFiles *wfiles, const RequestId &id) {
         if (match.matches(entry.filename, &reason) &&
             match_i.matches(entry.filename, &reason)) {
           bool interactive = wfiles->getFile(entry.filename) != nullptr;
-          args = entry.args;
+          args = entry.expandArgs();
           args.insert(args.end(), extra_args.begin(), extra_args.end());
           args.push_back(intern("-working-directory=" + entry.directory));
           pipeline::index(entry.filename, args,
@@ -669,12 +1189,13 @@ void Project::indexRelated(const std::string &path) {
     if (StringRef(path).startswith(root)) {
       for (const Project::Entry &entry : folder.entries) {
         std::string reason;
-        args = entry.args;
-        args.insert(args.end(), extra_args.begin(), extra_args.end());
-        args.push_back(intern("-working-directory=" + entry.directory));
         if (sys::path::stem(entry.filename) == stem && entry.filename != path &&
-            match.matches(entry.filename, &reason))
+            match.matches(entry.filename, &reason)) {
+          args = entry.expandArgs();
+          args.insert(args.end(), extra_args.begin(), extra_args.end());
+          args.push_back(intern("-working-directory=" + entry.directory));
           pipeline::index(entry.filename, args, IndexMode::Background, true);
+        }
       }
       break;
     }
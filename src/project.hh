@@ -7,6 +7,7 @@
 #include "lsp.hh"
 
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
@@ -18,16 +19,32 @@ struct WorkingFiles;
 std::pair<LanguageId, bool> lookupExtension(std::string_view filename);
 
 struct Project {
+  // Arguments shared by the entries whose arguments only differ in those
+  // named after the main source file (e.g. a.cc and -o a.o), which are nullptr
+  // here.
+  struct ArgSet {
+    std::vector<const char *> args;
+    // The part of argsFingerprint contributed by |args|.
+    uint64_t hash;
+  };
+
   struct Entry {
     std::string root;
     std::string directory;
     std::string filename;
     std::vector<const char *> args;
+    // Once loaded, entries in Folder::entries keep their arguments here instead
+    // of |args|: |file_args| fill the nullptr slots of |arg_set|. findEntry
+    // expands them into |args| and keeps |arg_set| if they are a prefix.
+    std::shared_ptr<const ArgSet> arg_set;
+    std::vector<const char *> file_args;
     // If true, this entry is inferred and was not read from disk.
     bool is_inferred = false;
     // 0 unless coming from a compile_commands.json entry.
     int compdb_size = 0;
     int id = -1;
+
+    std::vector<const char *> expandArgs() const;
   };
 
   struct Folder {
@@ -36,6 +53,12 @@ struct Project {
     std::vector<Entry> entries;
     std::unordered_map<std::string, int> path2entry_index;
     std::unordered_map<std::string, std::vector<const char *>> dot_ccls;
+    // For each directory containing compile_commands.json entries, indices of
+    // the entries nearest to it (a few per language). Used to infer flags.
+    std::unordered_map<std::string, std::vector<int>> dir2candidates;
+    // Indices of the compile_commands.json entries by the stem of their file
+    // names, so that include/foo/bar.h can find src/foo/bar.cc.
+    std::unordered_map<std::string, std::vector<int>> stem2entries;
   };
 
   std::mutex mtx;
@@ -67,4 +90,12 @@ struct Project {
   void index(WorkingFiles *wfiles, const RequestId &id);
   void indexRelated(const std::string &path);
 };
+
+// Returns a hash of the arguments of |entry| for |path|, stored in its cache
+// files to decide whether they are stale. Arguments matching cache.ignoreArgs
+// are left out as they cannot affect the AST. Arguments with the stem of the
+// main source file (e.g. a.cc and -o a.o) are abstracted out, so a header
+// whose flags are inferred from another source file keeps its cache files.
+// Arguments from entry.arg_set are not hashed again.
+uint64_t argsFingerprint(const Project::Entry &entry, const std::string &path);
 } // namespace ccls
@@ -34,6 +34,11 @@ void addRange(std::vector<T> &into, const std::vector<T> &from) {
   into.insert(into.end(), from.begin(), from.end());
 }
 
+template <typename T>
+void addRange(FileRefs<T> &into, const std::vector<T> &from) {
+  into.add(from);
+}
+
 template <typename T>
 void removeRange(std::vector<T> &from, const std::vector<T> &to_remove) {
   if (to_remove.size()) {
@@ -45,6 +50,11 @@ void removeRange(std::vector<T> &from, const std::vector<T> &to_remove) {
   }
 }
 
+template <typename T>
+void removeRange(FileRefs<T> &from, const std::vector<T> &to_remove) {
+  from.remove(to_remove);
+}
+
 QueryFile::DefUpdate buildFileDefUpdate(IndexFile &&indexed) {
   QueryFile::Def def;
   def.path = std::move(indexed.path);
@@ -69,8 +79,96 @@ bool tryReplaceDef(llvm::SmallVectorImpl<Q> &def_list, Q &&def) {
   return false;
 }
 
+void writeVarint(std::vector<uint8_t> &out, uint32_t v) {
+  for (; v >= 0x80; v >>= 7)
+    out.push_back(uint8_t(v | 0x80));
+  out.push_back(uint8_t(v));
+}
+
+uint32_t readVarint(const uint8_t *&p) {
+  uint32_t v = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t c = *p++;
+    v |= uint32_t(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return v;
+  }
+}
+
+uint32_t zigzag(int v) { return (uint32_t(v) << 1) ^ uint32_t(v >> 31); }
+int unzigzag(uint32_t v) { return int(v >> 1) ^ -int(v & 1); }
+
+// Lines and columns are stored modulo 2^16 so that every Range round-trips,
+// even if |prev| is not ordered before |cur|. |flag| is packed into the first
+// varint.
+void encodeRange(std::vector<uint8_t> &out, const Range &prev, const Range &cur,
+                 bool flag) {
+  uint16_t dline = cur.start.line - prev.start.line;
+  writeVarint(out, uint32_t(dline) << 1 | flag);
+  writeVarint(out, uint16_t(dline ? cur.start.column
+                                  : cur.start.column - prev.start.column));
+  uint16_t eline = cur.end.line - cur.start.line;
+  if (eline) {
+    writeVarint(out, uint32_t(eline) << 1 | 1);
+    writeVarint(out, uint16_t(cur.end.column));
+  } else {
+    writeVarint(out, uint32_t(uint16_t(cur.end.column - cur.start.column))
+                         << 1);
+  }
+}
+
+const uint8_t *decodeRange(const uint8_t *p, Range &r, bool &flag) {
+  uint32_t head = readVarint(p);
+  uint16_t dline = head >> 1, col = readVarint(p);
+  flag = head & 1;
+  r.start.line += dline;
+  r.start.column = dline ? int16_t(col) : int16_t(r.start.column + col);
+  uint32_t e = readVarint(p);
+  if (e & 1) {
+    r.end.line = r.start.line + uint16_t(e >> 1);
+    r.end.column = int16_t(readVarint(p));
+  } else {
+    r.end.line = r.start.line;
+    r.end.column = int16_t(r.start.column + uint16_t(e >> 1));
+  }
+  return p;
+}
 } // namespace
 
+void encodeRef(std::vector<uint8_t> &out, const Use &prev, const Use &u) {
+  bool role_changed = u.role != prev.role;
+  encodeRange(out, prev.range, u.range, role_changed);
+  if (role_changed)
+    writeVarint(out, uint16_t(u.role));
+}
+
+void encodeRef(std::vector<uint8_t> &out, const DeclRef &prev,
+               const DeclRef &u) {
+  encodeRef(out, static_cast<const Use &>(prev), u);
+  // |extent| usually encloses |range|, encode it relative to range.start.
+  writeVarint(out, zigzag(u.extent.start.line - u.range.start.line));
+  writeVarint(out, uint16_t(u.extent.start.column));
+  writeVarint(out, zigzag(u.extent.end.line - u.extent.start.line));
+  writeVarint(out, uint16_t(u.extent.end.column));
+}
+
+const uint8_t *decodeRef(const uint8_t *p, Use &u) {
+  bool role_changed;
+  p = decodeRange(p, u.range, role_changed);
+  if (role_changed)
+    u.role = Role(readVarint(p));
+  return p;
+}
+
+const uint8_t *decodeRef(const uint8_t *p, DeclRef &u) {
+  p = decodeRef(p, static_cast<Use &>(u));
+  u.extent.start.line = u.range.start.line + unzigzag(readVarint(p));
+  u.extent.start.column = int16_t(readVarint(p));
+  u.extent.end.line = u.extent.start.line + unzigzag(readVarint(p));
+  u.extent.end.column = int16_t(readVarint(p));
+  return p;
+}
+
 template <typename T> Vec<T> convert(const std::vector<T> &o) {
   Vec<T> r{std::make_unique<T[]>(o.size()), (int)o.size()};
   std::copy(o.begin(), o.end(), r.begin());
@@ -276,22 +374,26 @@ void DB::applyIndexUpdate(IndexUpdate *u) {
     use.file_id =
         use.file_id == -1 ? u->file_id : lid2fid.find(use.file_id)->second;
     ExtentRef sym{{use.range, usr, kind, use.role}};
-    int &v = files[use.file_id].symbol2refcnt[sym];
+    QueryFile &file = files[use.file_id];
+    int &v = file.symbol2refcnt[sym];
+    file.refcnt_gen++;
     v += delta;
     assert(v >= 0);
     if (!v)
-      files[use.file_id].symbol2refcnt.erase(sym);
+      file.symbol2refcnt.erase(sym);
   };
   auto refDecl = [&](std::unordered_map<int, int> &lid2fid, Usr usr, Kind kind,
                      DeclRef &dr, int delta) {
     dr.file_id =
         dr.file_id == -1 ? u->file_id : lid2fid.find(dr.file_id)->second;
     ExtentRef sym{{dr.range, usr, kind, dr.role}, dr.extent};
-    int &v = files[dr.file_id].symbol2refcnt[sym];
+    QueryFile &file = files[dr.file_id];
+    int &v = file.symbol2refcnt[sym];
+    file.refcnt_gen++;
     v += delta;
     assert(v >= 0);
     if (!v)
-      files[dr.file_id].symbol2refcnt.erase(sym);
+      file.symbol2refcnt.erase(sym);
   };
 
   auto updateUses =
@@ -426,9 +528,11 @@ void DB::update(const Lid2file_id &lid2file_id, int file_id,
     u.second.file_id = file_id;
     if (def.spell) {
       assignFileId(lid2file_id, file_id, *def.spell);
-      files[def.spell->file_id].symbol2refcnt[{
+      QueryFile &file = files[def.spell->file_id];
+      file.symbol2refcnt[{
           {def.spell->range, u.first, Kind::Func, def.spell->role},
           def.spell->extent}]++;
+      file.refcnt_gen++;
     }
 
     auto r = func_usr.try_emplace({u.first}, func_usr.size());
@@ -449,9 +553,11 @@ void DB::update(const Lid2file_id &lid2file_id, int file_id,
     u.second.file_id = file_id;
     if (def.spell) {
       assignFileId(lid2file_id, file_id, *def.spell);
-      files[def.spell->file_id].symbol2refcnt[{
+      QueryFile &file = files[def.spell->file_id];
+      file.symbol2refcnt[{
           {def.spell->range, u.first, Kind::Type, def.spell->role},
           def.spell->extent}]++;
+      file.refcnt_gen++;
     }
     auto r = type_usr.try_emplace({u.first}, type_usr.size());
     if (r.second)
@@ -471,9 +577,11 @@ void DB::update(const Lid2file_id &lid2file_id, int file_id,
     u.second.file_id = file_id;
     if (def.spell) {
       assignFileId(lid2file_id, file_id, *def.spell);
-      files[def.spell->file_id].symbol2refcnt[{
+      QueryFile &file = files[def.spell->file_id];
+      file.symbol2refcnt[{
           {def.spell->range, u.first, Kind::Var, def.spell->role},
           def.spell->extent}]++;
+      file.refcnt_gen++;
     }
     auto r = var_usr.try_emplace({u.first}, var_usr.size());
     if (r.second)
@@ -552,7 +660,7 @@ getDeclarations(llvm::DenseMap<Usr, int, DenseMapInfoForUsr> &entity_usr,
         break;
       }
     if (!has_def && entity.declarations.size())
-      ret.push_back(entity.declarations[0]);
+      ret.push_back(entity.declarations.front());
   }
   return ret;
 }
@@ -598,13 +706,13 @@ std::vector<DeclRef> getVarDeclarations(DB *db, const std::vector<Usr> &usrs,
         break;
       }
     if (!has_def && var.declarations.size())
-      ret.push_back(var.declarations[0]);
+      ret.push_back(var.declarations.front());
   }
   return ret;
 }
 
-std::vector<DeclRef> &getNonDefDeclarations(DB *db, SymbolIdx sym) {
-  static std::vector<DeclRef> empty;
+FileRefs<DeclRef> &getNonDefDeclarations(DB *db, SymbolIdx sym) {
+  static FileRefs<DeclRef> empty;
   switch (sym.kind) {
   case Kind::Func:
     return db->getFunc(sym).declarations;
@@ -10,6 +10,12 @@
 #include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/iterator_range.h>
+
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace llvm {
 template <> struct DenseMapInfo<ccls::ExtentRef> {
@@ -44,6 +50,8 @@ struct QueryFile {
   std::optional<Def> def;
   // `extent` is valid => declaration; invalid => regular reference
   llvm::DenseMap<ExtentRef, int> symbol2refcnt;
+  // Incremented whenever symbol2refcnt is modified.
+  int64_t refcnt_gen = 0;
 };
 
 template <typename Q, typename QDef> struct QueryEntity {
@@ -66,28 +74,184 @@ template <typename T>
 using Update =
     std::unordered_map<Usr, std::pair<std::vector<T>, std::vector<T>>>;
 
+// Compact encoding of a Use/DeclRef relative to the previous one in the same
+// file. Lines and columns are delta encoded as varints and the role is only
+// stored when it differs from the previous one. file_id is implied by the
+// bucket.
+void encodeRef(std::vector<uint8_t> &out, const Use &prev, const Use &u);
+void encodeRef(std::vector<uint8_t> &out, const DeclRef &prev,
+               const DeclRef &u);
+const uint8_t *decodeRef(const uint8_t *p, Use &u);
+const uint8_t *decodeRef(const uint8_t *p, DeclRef &u);
+
+// Uses or declarations of an entity, partitioned by file_id. The references
+// in a file are stored in one byte stream, sorted by range (see encodeRef),
+// which takes 3~6 bytes per Use instead of 16. |index| holds the files with
+// references in file_id order, so that replacing the references of a file
+// only re-encodes that file. Iterators decode references on the fly and yield
+// them by value.
+template <typename T> struct FileRefs {
+  struct Bucket {
+    int file_id;
+    std::vector<uint8_t> data;
+  };
+
+  struct iterator {
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = T;
+
+    const FileRefs *refs = nullptr;
+    size_t i = 0, e = 0;
+    const uint8_t *p = nullptr, *next = nullptr;
+    T cur;
+
+    iterator() = default;
+    iterator(const FileRefs *refs, size_t i, size_t e)
+        : refs(refs), i(i), e(e) {
+      if (i != e)
+        enter();
+    }
+
+    T operator*() const { return cur; }
+    pointer operator->() const { return &cur; }
+    iterator &operator++() {
+      const std::vector<uint8_t> &data = refs->index[i].data;
+      if (next != data.data() + data.size()) {
+        p = next;
+        next = decodeRef(p, cur);
+      } else if (++i != e) {
+        enter();
+      } else {
+        p = next = nullptr;
+      }
+      return *this;
+    }
+    iterator operator++(int) {
+      iterator ret = *this;
+      ++*this;
+      return ret;
+    }
+    bool operator==(const iterator &o) const { return i == o.i && p == o.p; }
+    bool operator!=(const iterator &o) const { return !(*this == o); }
+
+  private:
+    void enter() {
+      cur = T{};
+      cur.file_id = refs->index[i].file_id;
+      p = refs->index[i].data.data();
+      next = decodeRef(p, cur);
+    }
+  };
+
+  iterator begin() const { return {this, 0, index.size()}; }
+  iterator end() const { return {this, index.size(), index.size()}; }
+  size_t size() const { return count; }
+  bool empty() const { return !count; }
+  T front() const { return *begin(); }
+
+  // Returns the references of the |i|-th file in |index|.
+  llvm::iterator_range<iterator> inBucket(size_t i) const {
+    return {iterator(this, i, i + 1), iterator(this, i + 1, i + 1)};
+  }
+  // Returns the references in |file_id|.
+  llvm::iterator_range<iterator> inFile(int file_id) const {
+    size_t i = lowerBound(file_id);
+    if (i == index.size() || index[i].file_id != file_id)
+      return {end(), end()};
+    return inBucket(i);
+  }
+
+  void add(const std::vector<T> &from) {
+    std::map<int, std::vector<T>> file2refs;
+    for (const T &t : from)
+      file2refs[t.file_id].push_back(t);
+    for (auto &[file_id, added] : file2refs)
+      update(file_id, [&](std::vector<T> &refs) {
+        refs.insert(refs.end(), added.begin(), added.end());
+      });
+  }
+
+  void remove(const std::vector<T> &to_remove) {
+    std::map<int, std::unordered_set<T>> file2set;
+    for (const T &t : to_remove)
+      file2set[t.file_id].insert(t);
+    for (auto &[file_id, set] : file2set)
+      update(file_id, [&](std::vector<T> &refs) {
+        refs.erase(std::remove_if(refs.begin(), refs.end(),
+                                  [&](const T &t) { return set.count(t) > 0; }),
+                   refs.end());
+      });
+  }
+
+  std::vector<Bucket> index;
+  size_t count = 0;
+
+private:
+  size_t lowerBound(int file_id) const {
+    auto it = std::lower_bound(
+        index.begin(), index.end(), file_id,
+        [](const Bucket &b, int file_id) { return b.file_id < file_id; });
+    return it - index.begin();
+  }
+
+  // Decodes the references in |file_id| (empty if it has none), lets |fn|
+  // update them and re-encodes the bucket. Other files are left untouched.
+  template <typename Fn> void update(int file_id, Fn fn) {
+    size_t i = lowerBound(file_id);
+    bool found = i < index.size() && index[i].file_id == file_id;
+    std::vector<T> refs;
+    if (found)
+      for (T t : inBucket(i))
+        refs.push_back(t);
+    count -= refs.size();
+    fn(refs);
+    count += refs.size();
+    if (refs.empty()) {
+      if (found)
+        index.erase(index.begin() + i);
+      return;
+    }
+    if (!found)
+      index.insert(index.begin() + i, Bucket{file_id, {}});
+    std::stable_sort(refs.begin(), refs.end(), [](const T &l, const T &r) {
+      return l.range < r.range;
+    });
+    std::vector<uint8_t> &data = index[i].data;
+    data.clear();
+    T prev{};
+    for (const T &t : refs) {
+      encodeRef(data, prev, t);
+      prev = t;
+    }
+    data.shrink_to_fit();
+  }
+};
+
 struct QueryFunc : QueryEntity<QueryFunc, FuncDef<Vec>> {
   Usr usr;
   llvm::SmallVector<Def, 1> def;
-  std::vector<DeclRef> declarations;
+  FileRefs<DeclRef> declarations;
   std::vector<Usr> derived;
-  std::vector<Use> uses;
+  FileRefs<Use> uses;
 };
 
 struct QueryType : QueryEntity<QueryType, TypeDef<Vec>> {
   Usr usr;
   llvm::SmallVector<Def, 1> def;
-  std::vector<DeclRef> declarations;
+  FileRefs<DeclRef> declarations;
   std::vector<Usr> derived;
   std::vector<Usr> instances;
-  std::vector<Use> uses;
+  FileRefs<Use> uses;
 };
 
 struct QueryVar : QueryEntity<QueryVar, VarDef> {
   Usr usr;
   llvm::SmallVector<Def, 1> def;
-  std::vector<DeclRef> declarations;
-  std::vector<Use> uses;
+  FileRefs<DeclRef> declarations;
+  FileRefs<Use> uses;
 };
 
 struct IndexUpdate {
@@ -194,7 +358,7 @@ std::vector<DeclRef> getVarDeclarations(DB *, const std::vector<Usr> &,
                                         unsigned);
 
 // Get non-defining declarations.
-std::vector<DeclRef> &getNonDefDeclarations(DB *db, SymbolIdx sym);
+FileRefs<DeclRef> &getNonDefDeclarations(DB *db, SymbolIdx sym);
 
 std::vector<Use> getUsesForAllBases(DB *db, QueryFunc &root);
 std::vector<Use> getUsesForAllDerived(DB *db, QueryFunc &root);
@@ -8,19 +8,23 @@
 #include "log.hh"
 #include "pipeline.hh"
 #include "platform.hh"
+#include "utils.hh"
 
 #include <clang/Basic/TargetInfo.h>
 #include <clang/Lex/PreprocessorOptions.h>
 #include <clang/Sema/CodeCompleteConsumer.h>
 #include <clang/Sema/Sema.h>
+#include <llvm/ADT/StringExtras.h>
 #include <llvm/ADT/Twine.h>
 #include <llvm/Config/llvm-config.h>
+#include <llvm/Support/Chrono.h>
 #include <llvm/Support/CrashRecoveryContext.h>
 #include <llvm/Support/Threading.h>
 using namespace clang;
 using namespace llvm;
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <ratio>
 #include <thread>
@@ -123,19 +127,197 @@ struct PreambleStatCache {
   }
 };
 
+// A preamble stored as $directory/@preamble/$hash.pch when cache.preamble is
+// enabled, where $hash is computed by preambleHash. $hash.deps records the
+// bounds, the files the build stat'ed and the includes, so that the preamble
+// can be loaded after a restart or after its session has been evicted.
+struct PreambleFile {
+  struct Dep {
+    std::string path;
+    int64_t mtime; // -1 if the file did not exist
+    int64_t size;
+  };
+  std::string path;
+  uint64_t hash;
+  unsigned size;
+  bool ends_at_start_of_line;
+  std::vector<Dep> deps;
+};
+
+namespace {
+// Hashes the clang version, the compiler arguments and the preamble text. If
+// session.sharePreamble is enabled, the main file and the output file are
+// skipped, so that files with the same flags and include block collide.
+uint64_t preambleHash(const Project::Entry &entry, StringRef text) {
+  std::string key = LLVM_VERSION_STRING;
+  bool share = g_config->session.sharePreamble;
+  for (size_t i = 0; i < entry.args.size(); i++) {
+    std::string arg = entry.args[i];
+    if (share && i && arg == "-o") {
+      i++;
+      continue;
+    }
+    if (share && i && arg[0] != '-' &&
+        resolveIfRelative(entry.directory, arg) == entry.filename)
+      continue;
+    (key += '\0') += arg;
+  }
+  key += '\0';
+  key += text;
+  return hashUsr(key);
+}
+
+std::string preambleFilePath(uint64_t hash) {
+  return g_config->cache.directory + "@preamble/" + utohexstr(hash) + ".pch";
+}
+
+std::string depsPath(const PreambleFile &pf) {
+  return pf.path.substr(0, pf.path.size() - 3) + "deps";
+}
+
+// Number of live PreambleData per file in @preamble/. A file whose session
+// has moved on to a different preamble is marked obsolete and removed when
+// the last PreambleData using it goes away.
+struct PreambleFileRef {
+  int count = 0;
+  bool obsolete = false;
+};
+std::mutex preamble_file_mutex;
+std::unordered_map<uint64_t, PreambleFileRef> preamble_files;
+
+bool depsUnchanged(const std::vector<PreambleFile::Dep> &deps,
+                   llvm::vfs::FileSystem &fs) {
+  for (auto &dep : deps) {
+    auto s = fs.status(dep.path);
+    if (!s) {
+      if (dep.mtime >= 0)
+        return false;
+    } else if (dep.mtime < 0 || (int64_t)s->getSize() != dep.size ||
+               sys::toTimeT(s->getLastModificationTime()) != dep.mtime) {
+      return false;
+    }
+  }
+  return true;
+}
+} // namespace
+
 struct PreambleData {
-  PreambleData(clang::PrecompiledPreamble p, IncludeStructure includes,
+  PreambleData(std::optional<clang::PrecompiledPreamble> p,
+               std::unique_ptr<PreambleFile> file, IncludeStructure includes,
                std::vector<Diag> diags,
                std::unique_ptr<PreambleStatCache> stat_cache)
-      : preamble(std::move(p)), includes(std::move(includes)),
-        diags(std::move(diags)), stat_cache(std::move(stat_cache)) {}
-  clang::PrecompiledPreamble preamble;
+      : preamble(std::move(p)), file(std::move(file)),
+        includes(std::move(includes)), diags(std::move(diags)),
+        stat_cache(std::move(stat_cache)) {
+    if (this->file) {
+      std::lock_guard lock(preamble_file_mutex);
+      PreambleFileRef &ref = preamble_files[this->file->hash];
+      ref.count++;
+      ref.obsolete = false;
+    }
+  }
+  ~PreambleData() {
+    if (!file)
+      return;
+    std::lock_guard lock(preamble_file_mutex);
+    auto it = preamble_files.find(file->hash);
+    if (--it->second.count)
+      return;
+    // Without .deps (the main file had errors), the file cannot be loaded.
+    if (it->second.obsolete || !sys::fs::exists(depsPath(*file))) {
+      LOG_S(INFO) << "remove obsolete preamble " << file->path;
+      sys::fs::remove(file->path);
+      sys::fs::remove(depsPath(*file));
+    }
+    preamble_files.erase(it);
+  }
+  // Exactly one of them is set.
+  std::optional<clang::PrecompiledPreamble> preamble;
+  std::unique_ptr<PreambleFile> file;
   IncludeStructure includes;
   std::vector<Diag> diags;
   std::unique_ptr<PreambleStatCache> stat_cache;
+
+  size_t memoryUsage() const {
+    size_t ret = preamble ? preamble->getSize() : 0;
+    for (auto &e : stat_cache->cache)
+      ret += e.getKeyLength() + sizeof(e.getValue());
+    return ret;
+  }
+
+  PreambleBounds getBounds() const {
+    return preamble ? preamble->getBounds()
+                    : PreambleBounds(file->size, file->ends_at_start_of_line);
+  }
+
+  bool canReuse(const CompilerInvocation &ci, const llvm::MemoryBuffer &buf,
+                PreambleBounds bounds, llvm::vfs::FileSystem &fs,
+                uint64_t hash) const {
+    if (file)
+      return file->hash == hash && file->size == bounds.Size &&
+             file->ends_at_start_of_line == bounds.PreambleEndsAtStartOfLine &&
+             depsUnchanged(file->deps, fs);
+#if LLVM_VERSION_MAJOR >= 12 // llvmorg-12-init-17739-gf4d02fbe418d
+    return preamble->CanReuse(ci, buf, bounds, fs);
+#else
+    return preamble->CanReuse(ci, &buf, bounds, &fs);
+#endif
+  }
+
+  // Like PrecompiledPreamble::OverridePreamble.
+  void overridePreamble(CompilerInvocation &ci,
+                        IntrusiveRefCntPtr<llvm::vfs::FileSystem> &fs,
+                        llvm::MemoryBuffer *buf) const {
+    if (preamble) {
+      preamble->OverridePreamble(ci, fs, buf);
+      return;
+    }
+    auto &opts = ci.getPreprocessorOpts();
+    opts.addRemappedFile(ci.getFrontendOpts().Inputs[0].getFile(), buf);
+    opts.PrecompiledPreambleBytes = {file->size, file->ends_at_start_of_line};
+#if LLVM_VERSION_MAJOR >= 13
+    opts.DisablePCHOrModuleValidation = DisableValidationForModuleKind::PCH;
+#else
+    opts.DisablePCHValidation = true;
+#endif
+    opts.UsePredefines = false;
+    opts.ImplicitPCHInclude = file->path;
+  }
 };
 
 namespace {
+// Returns true if no |job| is running on |session| and marks it running.
+// Otherwise |task| is parked on the session and put back on |queue| when the
+// running job finishes, so that the worker can serve other files meanwhile.
+template <typename T>
+bool beginJob(Session &session, Session::Job job, ThreadedQueue<T> &queue,
+              T &task, bool priority) {
+  std::lock_guard lock(session.mutex);
+  if (!session.busy[job])
+    return session.busy[job] = true;
+  auto parked = std::make_shared<T>(std::move(task));
+  session.blocked[job].push_back([&queue, parked, priority]() {
+    queue.pushBack(std::move(*parked), priority);
+  });
+  return false;
+}
+
+// Ends the job started by beginJob and posts the tasks parked meanwhile.
+struct JobScope {
+  Session &session;
+  Session::Job job;
+  ~JobScope() {
+    std::vector<std::function<void()>> blocked;
+    {
+      std::lock_guard lock(session.mutex);
+      session.busy[job] = false;
+      blocked.swap(session.blocked[job]);
+    }
+    for (auto &post : blocked)
+      post();
+  }
+};
+
 bool locationInRange(SourceLocation l, CharSourceRange r,
                      const SourceManager &m) {
   assert(r.isCharRange());
@@ -210,6 +392,47 @@ public:
   IncludeStructure includes;
 };
 
+// Assigned to Session::preamble_gen whenever a preamble is installed.
+std::atomic<int64_t> preamble_gen;
+
+// Preambles without diagnostics in their main files, keyed by preambleHash.
+// With session.sharePreamble, a session whose arguments and preamble text match
+// an entry uses it instead of building its own. The sessions hold the
+// references and an entry expires with the last of them.
+std::mutex preamble_store_mutex;
+std::unordered_map<uint64_t, std::weak_ptr<PreambleData>> preamble_store;
+
+std::shared_ptr<PreambleData> findSharedPreamble(uint64_t hash) {
+  std::lock_guard lock(preamble_store_mutex);
+  auto it = preamble_store.find(hash);
+  return it == preamble_store.end() ? nullptr : it->second.lock();
+}
+
+void installPreamble(Session &session, std::shared_ptr<PreambleData> preamble,
+                     uint64_t hash, bool shareable) {
+  {
+    std::shared_ptr<PreambleData> oldP = session.getPreamble();
+    std::lock_guard lock(preamble_file_mutex);
+    if (oldP && oldP->file && oldP->file->hash != hash)
+      preamble_files[oldP->file->hash].obsolete = true;
+    // A shared preamble may have been given up by another session.
+    if (preamble->file)
+      preamble_files[hash].obsolete = false;
+  }
+  if (shareable && g_config->session.sharePreamble) {
+    std::lock_guard lock(preamble_store_mutex);
+    for (auto it = preamble_store.begin(); it != preamble_store.end();)
+      if (it->second.expired())
+        it = preamble_store.erase(it);
+      else
+        ++it;
+    preamble_store[hash] = preamble;
+  }
+  std::lock_guard lock(session.mutex);
+  session.preamble = std::move(preamble);
+  session.preamble_gen = ++preamble_gen;
+}
+
 class StoreDiags : public DiagnosticConsumer {
   const LangOptions *langOpts;
   std::optional<Diag> last;
@@ -304,7 +527,7 @@ buildCompilerInstance(Session &session, std::unique_ptr<CompilerInvocation> ci,
                       const std::string &main,
                       std::unique_ptr<llvm::MemoryBuffer> &buf) {
   if (preamble)
-    preamble->preamble.OverridePreamble(*ci, fs, buf.get());
+    preamble->overridePreamble(*ci, fs, buf.get());
   else
     ci->getPreprocessorOpts().addRemappedFile(main, buf.get());
 
@@ -335,13 +558,15 @@ buildCompilerInstance(Session &session, std::unique_ptr<CompilerInvocation> ci,
   return clang;
 }
 
-bool parse(CompilerInstance &clang) {
-  SyntaxOnlyAction action;
+bool parse(CompilerInstance &clang, FrontendAction &action,
+           llvm::function_ref<void()> on_begin = {}) {
   llvm::CrashRecoveryContext crc;
   bool ok = false;
   auto run = [&]() {
     if (!action.BeginSourceFile(clang, clang.getFrontendOpts().Inputs[0]))
       return;
+    if (on_begin)
+      on_begin();
 #if LLVM_VERSION_MAJOR >= 9 // rL364464
     if (llvm::Error e = action.Execute()) {
       llvm::consumeError(std::move(e));
@@ -359,6 +584,147 @@ bool parse(CompilerInstance &clang) {
   return ok;
 }
 
+bool parse(CompilerInstance &clang) {
+  SyntaxOnlyAction action;
+  return parse(clang, action);
+}
+
+std::unique_ptr<PreambleFile> readPreambleFile(uint64_t hash,
+                                               IncludeStructure &includes) {
+  auto pf = std::make_unique<PreambleFile>();
+  pf->path = preambleFilePath(hash);
+  pf->hash = hash;
+  std::optional<std::string> content = readContent(depsPath(*pf));
+  if (!content)
+    return nullptr;
+  SmallVector<StringRef, 0> lines;
+  StringRef(*content).split(lines, '\n', -1, false);
+  unsigned ends = 0;
+  if (lines.empty() || lines[0].split(' ').first.getAsInteger(10, pf->size) ||
+      lines[0].split(' ').second.getAsInteger(10, ends))
+    return nullptr;
+  pf->ends_at_start_of_line = ends;
+  for (StringRef line : ArrayRef<StringRef>(lines).drop_front()) {
+    // d $mtime $size $path or i $mtime $path
+    auto [kind, rest] = line.split(' ');
+    auto [mtime, rest1] = rest.split(' ');
+    int64_t t, size;
+    if (mtime.getAsInteger(10, t))
+      return nullptr;
+    if (kind == "i") {
+      includes.emplace_back(rest1.str(), t);
+    } else {
+      auto [size_str, path] = rest1.split(' ');
+      if (kind != "d" || size_str.getAsInteger(10, size))
+        return nullptr;
+      pf->deps.push_back({path.str(), t, size});
+    }
+  }
+  return pf;
+}
+
+const auto process_start = chrono::system_clock::now();
+
+// Removes the files in @preamble/ that cannot be loaded any more: a .pch
+// without .deps (its main file had errors), a .deps without .pch, changed
+// dependencies and leftover temporary files. Files written by this process,
+// e.g. a .pch whose .deps is not written yet, are kept.
+void sweepPreambleFiles() {
+  std::string dir = g_config->cache.directory + "@preamble";
+  IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs = llvm::vfs::getRealFileSystem();
+  std::unordered_map<uint64_t, bool> valid;
+  std::vector<std::string> removed;
+  std::error_code ec;
+  for (sys::fs::directory_iterator i(dir, ec, false), e; i != e && !ec;
+       i.increment(ec)) {
+    StringRef path = i->path(), ext = sys::path::extension(path);
+    uint64_t hash;
+    bool keep = false;
+    if ((ext == ".pch" || ext == ".deps") &&
+        !sys::path::stem(path).getAsInteger(16, hash)) {
+      auto [it, inserted] = valid.try_emplace(hash, false);
+      if (inserted) {
+        IncludeStructure includes;
+        std::unique_ptr<PreambleFile> pf = readPreambleFile(hash, includes);
+        it->second = pf && sys::fs::exists(pf->path) &&
+                     depsUnchanged(pf->deps, *fs);
+      }
+      keep = it->second;
+    }
+    sys::fs::file_status status;
+    if (!keep && !sys::fs::status(path, status) &&
+        status.getLastModificationTime() < process_start)
+      removed.push_back(path.str());
+  }
+  for (auto &path : removed)
+    sys::fs::remove(path);
+  if (removed.size())
+    LOG_S(INFO) << "removed " << removed.size() << " stale files from " << dir;
+}
+
+void writePreambleFile(const PreambleFile &pf,
+                       const IncludeStructure &includes) {
+  std::string out = std::to_string(pf.size) + ' ' +
+                    std::to_string(pf.ends_at_start_of_line) + '\n';
+  for (auto &dep : pf.deps)
+    out += "d " + std::to_string(dep.mtime) + ' ' + std::to_string(dep.size) +
+           ' ' + dep.path + '\n';
+  for (auto &include : includes)
+    out += "i " + std::to_string(include.second) + ' ' + include.first + '\n';
+  // Another session with the same hash may be reading it.
+  std::string path = depsPath(pf),
+              tmp = path + "." + std::to_string(get_threadid());
+  writeToFile(tmp, out);
+  sys::fs::rename(tmp, path);
+}
+
+// Builds the preamble into preambleFilePath(hash) with GeneratePCHAction, the
+// way PrecompiledPreamble::Build does in memory.
+std::unique_ptr<PreambleFile>
+buildPreambleFile(Session &session, const CompilerInvocation &ci,
+                  IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs,
+                  DiagnosticConsumer &dc, const std::string &main,
+                  const llvm::MemoryBuffer &buf, PreambleBounds bounds,
+                  uint64_t hash, IncludeStructure &includes) {
+  auto pf = std::make_unique<PreambleFile>();
+  pf->path = preambleFilePath(hash);
+  pf->hash = hash;
+  pf->size = bounds.Size;
+  pf->ends_at_start_of_line = bounds.PreambleEndsAtStartOfLine;
+  sys::fs::create_directories(sys::path::parent_path(pf->path));
+
+  auto ci1 = std::make_unique<CompilerInvocation>(ci);
+  auto &fOpts = ci1->getFrontendOpts();
+  fOpts.ProgramAction = frontend::GeneratePCH;
+  fOpts.OutputFile = pf->path;
+  fOpts.AllowPCHWithCompilerErrors = true;
+  fOpts.IncludeTimestamps = false;
+  auto &pOpts = ci1->getPreprocessorOpts();
+  pOpts.PrecompiledPreambleBytes = {0, false};
+  pOpts.GeneratePreamble = true;
+#if LLVM_VERSION_MAJOR >= 18
+  ci1->getLangOpts().CompilingPCH = true;
+#else
+  ci1->getLangOpts()->CompilingPCH = true;
+#endif
+  std::unique_ptr<llvm::MemoryBuffer> pbuf =
+      llvm::MemoryBuffer::getMemBufferCopy(
+          buf.getBuffer().substr(0, bounds.Size), main);
+  auto clang = buildCompilerInstance(session, std::move(ci1), fs, dc, nullptr,
+                                     main, pbuf);
+  if (!clang)
+    return nullptr;
+  GeneratePCHAction action;
+  if (!parse(*clang, action, [&]() {
+        clang->getPreprocessor().addPPCallbacks(
+            std::make_unique<StoreInclude>(clang->getSourceManager(),
+                                           includes));
+      }) ||
+      !sys::fs::exists(pf->path))
+    return nullptr;
+  return pf;
+}
+
 void buildPreamble(Session &session, CompilerInvocation &ci,
                    IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs,
                    const SemaManager::PreambleTask &task,
@@ -367,23 +733,44 @@ void buildPreamble(Session &session, CompilerInvocation &ci,
   std::string content = session.wfiles->getContent(task.path);
   std::unique_ptr<llvm::MemoryBuffer> buf =
       llvm::MemoryBuffer::getMemBuffer(content);
-#if LLVM_VERSION_MAJOR >= 12
 #if LLVM_VERSION_MAJOR >= 18
   auto bounds = ComputePreambleBounds(ci.getLangOpts(), *buf, 0);
-#else
-  // llvmorg-12-init-11522-g4c55c3b66de
+#elif LLVM_VERSION_MAJOR >= 12 // llvmorg-12-init-11522-g4c55c3b66de
   auto bounds = ComputePreambleBounds(*ci.getLangOpts(), *buf, 0);
-#endif
-  // llvmorg-12-init-17739-gf4d02fbe418d
-  if (!task.from_diag && oldP &&
-      oldP->preamble.CanReuse(ci, *buf, bounds, *fs))
-    return;
 #else
   auto bounds = ComputePreambleBounds(*ci.getLangOpts(), buf.get(), 0);
-  if (!task.from_diag && oldP &&
-      oldP->preamble.CanReuse(ci, buf.get(), bounds, fs.get()))
-    return;
 #endif
+  uint64_t hash =
+      preambleHash(session.file, StringRef(content).substr(0, bounds.Size));
+  if (!task.from_diag && oldP && oldP->canReuse(ci, *buf, bounds, *fs, hash))
+    return;
+  if (!task.from_diag && g_config->session.sharePreamble)
+    if (auto shared = findSharedPreamble(hash);
+        shared && shared != oldP &&
+        shared->canReuse(ci, *buf, bounds, *fs, hash)) {
+      LOG_S(INFO) << "share preamble for " << task.path;
+      installPreamble(session, std::move(shared), hash, false);
+      return;
+    }
+  bool use_file = g_config->cache.preamble && g_config->cache.directory.size();
+  // A rebuild from diagnosticMain is due to modified buffers of included files,
+  // which the preamble on disk does not reflect.
+  if (use_file && !task.from_diag) {
+    IncludeStructure includes;
+    if (auto pf = readPreambleFile(hash, includes);
+        pf && pf->size == bounds.Size &&
+        pf->ends_at_start_of_line == bounds.PreambleEndsAtStartOfLine &&
+        sys::fs::exists(pf->path) && depsUnchanged(pf->deps, *fs)) {
+      LOG_S(INFO) << "load preamble of " << task.path << " from " << pf->path;
+      installPreamble(session,
+                      std::make_shared<PreambleData>(
+                          std::nullopt, std::move(pf), std::move(includes),
+                          std::vector<Diag>(),
+                          std::make_unique<PreambleStatCache>()),
+                      hash, true);
+      return;
+    }
+  }
   // -Werror makes warnings issued as errors, which stops parsing
   // prematurely because of -ferror-limit=. This also works around the issue
   // of -Werror + -Wunused-parameter in interaction with SkipFunctionBodies.
@@ -402,42 +789,90 @@ void buildPreamble(Session &session, CompilerInvocation &ci,
   StoreDiags dc(task.path);
   IntrusiveRefCntPtr<DiagnosticsEngine> de =
       CompilerInstance::createDiagnostics(&ci.getDiagnosticOpts(), &dc, false);
+  bool remapped = false;
   if (oldP) {
     std::lock_guard lock(session.wfiles->mutex);
     for (auto &include : oldP->includes)
-      if (WorkingFile *wf = session.wfiles->getFileUnlocked(include.first))
+      if (WorkingFile *wf = session.wfiles->getFileUnlocked(include.first)) {
         ci.getPreprocessorOpts().addRemappedFile(
             include.first,
             llvm::MemoryBuffer::getMemBufferCopy(wf->buffer_content).release());
+        remapped = true;
+      }
   }
+  // The preamble on disk must not depend on unsaved buffers.
+  use_file = use_file && !remapped;
 
-  CclsPreambleCallbacks pc;
-  if (auto newPreamble = PrecompiledPreamble::Build(
-          ci, buf.get(), bounds, *de, fs, session.pch, true,
+  std::optional<PrecompiledPreamble> newPreamble;
+  std::unique_ptr<PreambleFile> pf;
+  IncludeStructure includes;
+  if (use_file) {
+    pf = buildPreambleFile(session, ci, fs, dc, task.path, *buf, bounds, hash,
+                           includes);
+    if (!pf) {
+      LOG_S(WARNING) << "failed to write preamble of " << task.path
+                     << ", build it in memory";
+      dc.take();
+      includes.clear();
+    }
+  }
+  if (!pf) {
+    CclsPreambleCallbacks pc;
+    auto p = PrecompiledPreamble::Build(ci, buf.get(), bounds, *de, fs,
+                                        session.pch, true,
 #if LLVM_VERSION_MAJOR >= 17 // llvmorg-17-init-4072-gcc929590ad30
-          "",
+                                        "",
 #endif
-          pc)) {
+                                        pc);
+    if (!p)
+      return;
     assert(!ci.getPreprocessorOpts().RetainRemappedFileBuffers);
-    if (oldP) {
-      auto &old_includes = oldP->includes;
-      auto it = old_includes.begin();
-      std::sort(pc.includes.begin(), pc.includes.end());
-      for (auto &include : pc.includes)
-        if (include.second == 0) {
-          while (it != old_includes.end() && it->first < include.first)
-            ++it;
-          if (it == old_includes.end())
-            break;
-          include.second = it->second;
-        }
-    }
+    newPreamble.emplace(std::move(*p));
+    includes = std::move(pc.includes);
+  }
+  if (oldP) {
+    auto &old_includes = oldP->includes;
+    auto it = old_includes.begin();
+    std::sort(includes.begin(), includes.end());
+    for (auto &include : includes)
+      if (include.second == 0) {
+        while (it != old_includes.end() && it->first < include.first)
+          ++it;
+        if (it == old_includes.end())
+          break;
+        include.second = it->second;
+      }
+  }
 
-    std::lock_guard lock(session.mutex);
-    session.preamble = std::make_shared<PreambleData>(
-        std::move(*newPreamble), std::move(pc.includes), dc.take(),
-        std::move(stat_cache));
+  std::vector<Diag> diags = dc.take();
+  // Diagnostics in the main file are not stored on disk and do not apply to
+  // other sessions.
+  bool clean = std::none_of(diags.begin(), diags.end(),
+                            [](const Diag &d) { return d.concerned; });
+  if (pf) {
+    // The main file is covered by the hash.
+    for (auto &e : stat_cache->cache)
+      if (e.getKey() != task.path) {
+        auto &s = e.getValue();
+        if (!s)
+          pf->deps.push_back({e.getKey().str(), -1, 0});
+        else if (s->isRegularFile())
+          pf->deps.push_back({e.getKey().str(),
+                              sys::toTimeT(s->getLastModificationTime()),
+                              (int64_t)s->getSize()});
+      }
+    if (clean)
+      writePreambleFile(*pf, includes);
+    else
+      sys::fs::remove(depsPath(*pf));
   }
+
+  installPreamble(session,
+                  std::make_shared<PreambleData>(
+                      std::move(newPreamble), std::move(pf),
+                      std::move(includes), std::move(diags),
+                      std::move(stat_cache)),
+                  hash, clean && !remapped);
 }
 
 void *preambleMain(void *manager_) {
@@ -452,6 +887,10 @@ void *preambleMain(void *manager_) {
     bool created = false;
     std::shared_ptr<Session> session =
         manager->ensureSession(task.path, &created);
+    if (!beginJob(*session, Session::PreambleJob, manager->preamble_tasks,
+                  task, true))
+      continue;
+    JobScope job{*session, Session::PreambleJob};
 
     auto stat_cache = std::make_unique<PreambleStatCache>();
     IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs =
@@ -459,6 +898,7 @@ void *preambleMain(void *manager_) {
     if (std::unique_ptr<CompilerInvocation> ci =
             buildCompilerInvocation(task.path, session->file.args, fs))
       buildPreamble(*session, *ci, fs, task, std::move(stat_cache));
+    manager->trimSessions();
 
     if (task.comp_task) {
       manager->comp_tasks.pushBack(std::move(task.comp_task));
@@ -483,18 +923,27 @@ void *completionMain(void *manager_) {
     if (pipeline::g_quit.load(std::memory_order_relaxed))
       break;
 
-    // Drop older requests if we're not buffering.
-    while (g_config->completion.dropOldRequests &&
-           !manager->comp_tasks.isEmpty()) {
+    // Drop older requests if we're not buffering. Use tryPopFront as another
+    // worker may take the queued request first.
+    while (g_config->completion.dropOldRequests) {
+      auto next = manager->comp_tasks.tryPopFront();
+      if (!next)
+        break;
       manager->on_dropped_(task->id);
       task->consumer.reset();
       task->on_complete(nullptr);
-      task = manager->comp_tasks.dequeue();
+      task = std::move(*next);
       if (pipeline::g_quit.load(std::memory_order_relaxed))
         break;
     }
+    if (pipeline::g_quit.load(std::memory_order_relaxed))
+      break;
 
     std::shared_ptr<Session> session = manager->ensureSession(task->path);
+    if (!beginJob(*session, Session::CompletionJob, manager->comp_tasks, task,
+                  false))
+      continue;
+    JobScope job{*session, Session::CompletionJob};
     std::shared_ptr<PreambleData> preamble = session->getPreamble();
     IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs =
         preamble ? preamble->stat_cache->consumer(session->fs) : session->fs;
@@ -531,7 +980,7 @@ void *completionMain(void *manager_) {
                              content) < (int)bounds.Size;
     if (in_preamble) {
       preamble.reset();
-    } else if (preamble && bounds.Size != preamble->preamble.getBounds().Size) {
+    } else if (preamble && bounds.Size != preamble->getBounds().Size) {
       manager->preamble_tasks.pushBack({task->path, std::move(task), false},
                                        true);
       continue;
@@ -596,6 +1045,10 @@ void *diagnosticMain(void *manager_) {
           chrono::duration<int64_t, std::milli>(std::min(wait, task.debounce)));
 
     std::shared_ptr<Session> session = manager->ensureSession(task.path);
+    if (!beginJob(*session, Session::DiagJob, manager->diag_tasks, task,
+                  false))
+      continue;
+    JobScope job{*session, Session::DiagJob};
     std::shared_ptr<PreambleData> preamble = session->getPreamble();
     IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs =
         preamble ? preamble->stat_cache->consumer(session->fs) : session->fs;
@@ -627,7 +1080,7 @@ void *diagnosticMain(void *manager_) {
         PreambleBounds bounds =
             ComputePreambleBounds(*ci->getLangOpts(), buf.get(), 0);
 #endif
-        if (bounds.Size != preamble->preamble.getBounds().Size)
+        if (bounds.Size != preamble->getBounds().Size)
           rebuild = true;
       }
       if (rebuild) {
@@ -813,15 +1266,62 @@ SemaManager::ensureSession(const std::string &path, bool *created) {
   return session;
 }
 
+int64_t SemaManager::preambleGeneration(const std::string &path) {
+  std::shared_ptr<ccls::Session> session;
+  {
+    std::lock_guard lock(mutex);
+    session = sessions.get(path);
+  }
+  if (!session)
+    return -1;
+  std::lock_guard lock(session->mutex);
+  return session->preamble_gen;
+}
+
+void SemaManager::trimSessions() {
+  int budget = g_config->session.memoryBudget;
+  if (budget <= 0)
+    return;
+  // Approximate number of bytes held by the preambles. A preamble stored in
+  // the cache directory is only mapped while parsing and is not counted. A
+  // shared preamble is counted once and freed with the last of its sessions.
+  std::unordered_map<const PreambleData *, int> refs;
+  std::lock_guard lock(mutex);
+  sessions.trim(size_t(budget) << 20,
+                [&](ccls::Session &session, bool add) -> size_t {
+                  std::shared_ptr<PreambleData> p = session.getPreamble();
+                  if (!p)
+                    return 0;
+                  int &n = refs[p.get()];
+                  return (add ? n++ == 0 : --n == 0) ? p->memoryUsage() : 0;
+                });
+}
+
 void SemaManager::clear() {
   LOG_S(INFO) << "clear all sessions";
   std::lock_guard lock(mutex);
   sessions.clear();
 }
 
+void SemaManager::startWorkers() {
+  auto &s = g_config->session;
+  static std::once_flag sweep;
+  if (g_config->cache.preamble && g_config->cache.directory.size())
+    std::call_once(sweep, sweepPreambleFiles);
+  for (; preamble_threads < s.preambleThreads; preamble_threads++)
+    spawnThread(ccls::preambleMain, this);
+  for (; comp_threads < s.completionThreads; comp_threads++)
+    spawnThread(ccls::completionMain, this);
+  for (; diag_threads < s.diagnosticThreads; diag_threads++)
+    spawnThread(ccls::diagnosticMain, this);
+}
+
 void SemaManager::quit() {
-  comp_tasks.pushBack(nullptr);
-  diag_tasks.pushBack({});
-  preamble_tasks.pushBack({});
+  for (int i = 0; i < comp_threads; i++)
+    comp_tasks.pushBack(nullptr);
+  for (int i = 0; i < diag_threads; i++)
+    diag_tasks.pushBack({});
+  for (int i = 0; i < preamble_threads; i++)
+    preamble_tasks.pushBack({});
 }
 } // namespace ccls
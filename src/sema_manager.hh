@@ -15,6 +15,7 @@
 
 #include <algorithm>
 #include <functional>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -42,40 +43,72 @@ TextEdit toTextEdit(const clang::SourceManager &SM, const clang::LangOptions &L,
 
 template <typename K, typename V> struct LruCache {
   std::shared_ptr<V> get(const K &key) {
-    for (auto it = items.begin(); it != items.end(); ++it)
-      if (it->first == key) {
-        auto x = std::move(*it);
-        std::move_backward(items.begin(), it, it + 1);
-        items[0] = std::move(x);
-        return items[0].second;
-      }
-    return nullptr;
+    auto it = index.find(key);
+    if (it == index.end())
+      return nullptr;
+    items.splice(items.begin(), items, it->second);
+    return it->second->second;
   }
   std::shared_ptr<V> take(const K &key) {
-    for (auto it = items.begin(); it != items.end(); ++it)
-      if (it->first == key) {
-        auto x = std::move(it->second);
-        items.erase(it);
-        return x;
-      }
-    return nullptr;
+    auto it = index.find(key);
+    if (it == index.end())
+      return nullptr;
+    auto x = std::move(it->second->second);
+    items.erase(it->second);
+    index.erase(it);
+    return x;
   }
   void insert(const K &key, std::shared_ptr<V> value) {
+    take(key);
     if ((int)items.size() >= capacity)
-      items.pop_back();
-    items.emplace(items.begin(), key, std::move(value));
+      popBack();
+    items.emplace_front(key, std::move(value));
+    index[key] = items.begin();
+  }
+  // Removes the least recently used entries until the total size of the rest
+  // is within |budget|. The most recently used entry is always kept.
+  // size(v, true) returns the bytes v adds to the total and size(v, false) the
+  // bytes its removal frees, which may differ if entries share memory.
+  template <typename Fn> void trim(size_t budget, Fn &&size) {
+    size_t total = 0;
+    for (auto &item : items)
+      total += size(*item.second, true);
+    while (total > budget && items.size() > 1) {
+      total -= std::min(total, size(*items.back().second, false));
+      popBack();
+    }
+  }
+  void clear() {
+    items.clear();
+    index.clear();
   }
-  void clear() { items.clear(); }
   void setCapacity(int cap) { capacity = cap; }
 
 private:
-  std::vector<std::pair<K, std::shared_ptr<V>>> items;
+  void popBack() {
+    index.erase(items.back().first);
+    items.pop_back();
+  }
+
+  using List = std::list<std::pair<K, std::shared_ptr<V>>>;
+  List items;
+  std::unordered_map<K, typename List::iterator> index;
   int capacity = 1;
 };
 
 struct Session {
   std::mutex mutex;
   std::shared_ptr<PreambleData> preamble;
+  // Assigned from a global counter whenever |preamble| is replaced, so that
+  // results computed against an older preamble can be told apart.
+  int64_t preamble_gen = 0;
+  // Jobs of one kind on the file run one at a time. A preamble build does not
+  // hold back completion or diagnostics, which use the previous preamble
+  // meanwhile. A job that finds its kind running is parked in |blocked| and
+  // queued again when the running job finishes. Guarded by |mutex|.
+  enum Job { PreambleJob, CompletionJob, DiagJob, NumJobs };
+  bool busy[NumJobs] = {};
+  std::vector<std::function<void()>> blocked[NumJobs];
 
   Project::Entry file;
   WorkingFiles *wfiles;
@@ -136,7 +169,16 @@ struct SemaManager {
   void onClose(const std::string &path);
   std::shared_ptr<ccls::Session> ensureSession(const std::string &path,
                                                bool *created = nullptr);
+  // Returns the preamble generation of the session of |path|, or -1 if there
+  // is no session.
+  int64_t preambleGeneration(const std::string &path);
   void clear();
+  // Evicts the least recently used sessions if they exceed
+  // session.memoryBudget.
+  void trimSessions();
+  // Starts the threads configured by g_config->session in addition to the
+  // ones started by the constructor.
+  void startWorkers();
   void quit();
 
   // Global state.
@@ -154,30 +196,63 @@ struct SemaManager {
   ThreadedQueue<std::unique_ptr<CompTask>> comp_tasks;
   ThreadedQueue<DiagTask> diag_tasks;
   ThreadedQueue<PreambleTask> preamble_tasks;
+  int comp_threads = 1, diag_threads = 1, preamble_threads = 1;
 
   std::shared_ptr<clang::PCHContainerOperations> pch;
 };
 
 // Cached completion information, so we can give fast completion results when
-// the user erases a character. vscode will resend the completion request if
-// that happens.
+// the user types or erases a character after the completion position. vscode
+// will resend the completion request if that happens. The most recently used
+// results come first. An entry is identified by the file, the preamble
+// generation, the completion position and the line prefix before it.
 template <typename T> struct CompleteConsumerCache {
+  struct Entry {
+    std::string path;
+    std::string line;
+    Position position;
+    int64_t preamble_gen;
+    T result;
+
+    bool matches(const std::string &path, const std::string &line,
+                 Position position, int64_t preamble_gen) const {
+      return this->position == position &&
+             this->preamble_gen == preamble_gen && this->path == path &&
+             this->line.compare(0, position.character, line, 0,
+                                position.character) == 0;
+    }
+  };
   std::mutex mutex;
-  std::string path;
-  std::string line;
-  Position position;
-  T result;
+  std::vector<Entry> entries;
 
-  template <typename Fn> void withLock(Fn &&fn) {
+  // If there is a matching entry, calls |fn| with its result under the lock
+  // and returns true.
+  template <typename Fn>
+  bool withResult(const std::string &path, const std::string &line,
+                  Position position, int64_t preamble_gen, Fn &&fn) {
     std::lock_guard lock(mutex);
-    fn();
+    for (auto it = entries.begin(); it != entries.end(); ++it)
+      if (it->matches(path, line, position, preamble_gen)) {
+        std::rotate(entries.begin(), it, it + 1);
+        fn(entries[0].result);
+        return true;
+      }
+    return false;
   }
-  bool isCacheValid(const std::string &path, const std::string &line,
-                    Position position) {
+  void insert(const std::string &path, const std::string &line,
+              Position position, int64_t preamble_gen, T result,
+              int capacity) {
     std::lock_guard lock(mutex);
-    return this->position == position && this->path == path &&
-           this->line.compare(0, position.character, line, 0,
-                              position.character) == 0;
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                 [&](const Entry &e) {
+                                   return e.matches(path, line, position,
+                                                    preamble_gen);
+                                 }),
+                  entries.end());
+    entries.insert(entries.begin(),
+                   {path, line, position, preamble_gen, std::move(result)});
+    if ((int)entries.size() > std::max(capacity, 1))
+      entries.resize(std::max(capacity, 1));
   }
 };
 } // namespace ccls
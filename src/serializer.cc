@@ -368,6 +368,7 @@ template <typename TVisitor> void reflect1(TVisitor &vis, IndexFile &v) {
     REFLECT_MEMBER(lid2path);
     REFLECT_MEMBER(import_file);
     REFLECT_MEMBER(args);
+    REFLECT_MEMBER(args_hash);
     REFLECT_MEMBER(dependencies);
   }
   REFLECT_MEMBER(includes);
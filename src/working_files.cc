@@ -12,6 +12,7 @@
 #include <chrono>
 #include <climits>
 #include <numeric>
+#include <string.h>
 namespace chrono = std::chrono;
 
 using namespace clang;
@@ -27,32 +28,31 @@ constexpr int kMaxDiff = 20;
 // |kMaxColumnAlignSize|.
 constexpr int kMaxColumnAlignSize = 200;
 
-Position getPositionForOffset(const std::string &content, int offset) {
-  if (offset >= content.size())
-    offset = (int)content.size() - 1;
+// Appends base + the offset following each '\n' in |s| to |out|. memchr is
+// vectorized by the C library, which is much faster than a byte loop.
+void scanNewlines(std::string_view s, int base, std::vector<int> &out) {
+  const char *p = s.data(), *e = p + s.size();
+  while ((p = static_cast<const char *>(memchr(p, '\n', e - p))))
+    out.push_back(base + int(++p - s.data()));
+}
 
-  int line = 0, col = 0;
-  int i = 0;
-  for (; i < offset; i++) {
-    if (content[i] == '\n')
-      line++, col = 0;
-    else
-      col++;
+std::vector<std::string_view> toLines(std::string_view c,
+                                      const std::vector<int> &starts) {
+  std::vector<std::string_view> ret;
+  ret.reserve(starts.size());
+  for (size_t i = 0; i + 1 < starts.size(); i++) {
+    int b = starts[i], e = starts[i + 1] - 1;
+    ret.push_back(c.substr(b, e - b - (e > b && c[e - 1] == '\r')));
   }
-  return {line, col};
+  if (starts.back() < c.size())
+    ret.push_back(c.substr(starts.back()));
+  return ret;
 }
 
-std::vector<std::string> toLines(const std::string &c) {
-  std::vector<std::string> ret;
-  int last = 0, e = c.size();
-  for (int i = 0; i < e; i++)
-    if (c[i] == '\n') {
-      ret.emplace_back(&c[last], i - last - (i && c[i - 1] == '\r'));
-      last = i + 1;
-    }
-  if (last < e)
-    ret.emplace_back(&c[last], e - last);
-  return ret;
+std::vector<std::string_view> toLines(std::string_view c) {
+  std::vector<int> starts{0};
+  scanNewlines(c, 0, starts);
+  return toLines(c, starts);
 }
 
 // Computes the edit distance of strings [a,a+la) and [b,b+lb) with Eugene W.
@@ -94,7 +94,7 @@ int myersDiff(const char *a, int la, const char *b, int lb, int threshold) {
   return threshold + 1;
 }
 
-int myersDiff(const std::string &a, const std::string &b, int threshold) {
+int myersDiff(std::string_view a, std::string_view b, int threshold) {
   return myersDiff(a.data(), a.size(), b.data(), b.size(), threshold);
 }
 
@@ -104,7 +104,7 @@ int myersDiff(const std::string &a, const std::string &b, int threshold) {
 // Myers' diff algorithm is used to find best matching line while this one is
 // used to align a single column because Myers' needs some twiddling to return
 // distance vector.
-std::vector<int> editDistanceVector(std::string a, std::string b) {
+std::vector<int> editDistanceVector(std::string_view a, std::string_view b) {
   std::vector<int> d(b.size() + 1);
   std::iota(d.begin(), d.end(), 0);
   for (int i = 0; i < (int)a.size(); i++) {
@@ -121,7 +121,8 @@ std::vector<int> editDistanceVector(std::string a, std::string b) {
 
 // Find matching position of |a[column]| in |b|.
 // This is actually a single step of Hirschberg's sequence alignment algorithm.
-int alignColumn(const std::string &a, int column, std::string b, bool is_end) {
+int alignColumn(std::string_view a, int column, std::string_view b,
+                bool is_end) {
   int head = 0, tail = 0;
   while (head < (int)a.size() && head < (int)b.size() && a[head] == b[head])
     head++;
@@ -143,10 +144,11 @@ int alignColumn(const std::string &a, int column, std::string b, bool is_end) {
 
   // right[i] = cost of aligning a[column, a.size() - tail) to b[head + i,
   // b.size() - tail)
-  std::string a_rev = a.substr(column, a.size() - tail - column);
+  std::string a_rev(a.substr(column, a.size() - tail - column));
   std::reverse(a_rev.begin(), a_rev.end());
-  std::reverse(b.begin(), b.end());
-  std::vector<int> right = editDistanceVector(a_rev, b);
+  std::string b_rev(b);
+  std::reverse(b_rev.begin(), b_rev.end());
+  std::vector<int> right = editDistanceVector(a_rev, b_rev);
   std::reverse(right.begin(), right.end());
 
   int best = 0, best_cost = INT_MAX;
@@ -164,9 +166,10 @@ int alignColumn(const std::string &a, int column, std::string b, bool is_end) {
 // By symmetry, this can also be used to find matching index line of a buffer
 // line.
 std::optional<int>
-findMatchingLine(const std::vector<std::string> &index_lines,
+findMatchingLine(const std::vector<std::string_view> &index_lines,
                  const std::vector<int> &index_to_buffer, int line, int *column,
-                 const std::vector<std::string> &buffer_lines, bool is_end) {
+                 const std::vector<std::string_view> &buffer_lines,
+                 bool is_end) {
   // If this is a confident mapping, returns.
   if (index_to_buffer[line] >= 0) {
     int ret = index_to_buffer[line];
@@ -191,7 +194,7 @@ findMatchingLine(const std::vector<std::string> &index_lines,
   // Search for lines [up,down] and use Myers's diff algorithm to find the best
   // match (least edit distance).
   int best = up, best_dist = kMaxDiff + 1;
-  const std::string &needle = index_lines[line];
+  std::string_view needle = index_lines[line];
   for (int i = up; i <= down; i++) {
     int dist = myersDiff(needle, buffer_lines[i], kMaxDiff);
     if (dist < best_dist) {
@@ -215,7 +218,8 @@ WorkingFile::WorkingFile(const std::string &filename,
   // setIndexContent gets called when the file is opened.
 }
 
-void WorkingFile::setIndexContent(const std::string &index_content) {
+void WorkingFile::setIndexContent(const std::string &content) {
+  index_content = content;
   index_lines = toLines(index_content);
 
   index_to_buffer.clear();
@@ -223,10 +227,50 @@ void WorkingFile::setIndexContent(const std::string &index_content) {
 }
 
 void WorkingFile::onBufferContentUpdated() {
-  buffer_lines = toLines(buffer_content);
-
+  line_starts.assign(1, 0);
+  scanNewlines(buffer_content, 0, line_starts);
   index_to_buffer.clear();
   buffer_to_index.clear();
+  updateBufferLines();
+}
+
+void WorkingFile::updateLineStarts(int start, int end, std::string_view text) {
+  // The lines starting in (start, end] are removed, the lines starting after
+  // end are shifted, and the newlines in |text| start new lines.
+  auto b = std::upper_bound(line_starts.begin(), line_starts.end(), start);
+  auto e = std::upper_bound(b, line_starts.end(), end);
+  int delta = int(text.size()) - (end - start);
+  for (auto it = e; it != line_starts.end(); ++it)
+    *it += delta;
+  std::vector<int> inserted;
+  scanNewlines(text, start, inserted);
+  line_starts.insert(line_starts.erase(b, e), inserted.begin(), inserted.end());
+}
+
+void WorkingFile::onLinesReplaced(int first, int last, int count) {
+  // Lines before |first| are unchanged and lines after |last| are shifted.
+  // The replaced lines become unconfident; findMatchingLine resolves them from
+  // the nearest confident lines.
+  int delta = count - (last - first + 1);
+  for (int &j : index_to_buffer)
+    if (j > last)
+      j += delta;
+    else if (j >= first)
+      j = -1;
+}
+
+void WorkingFile::updateBufferLines() {
+  buffer_lines = toLines(buffer_content, line_starts);
+  if (index_to_buffer.empty())
+    return;
+  buffer_to_index.assign(buffer_lines.size(), -1);
+  for (int i = 0; i < (int)index_to_buffer.size(); i++) {
+    int &j = index_to_buffer[i];
+    if (j >= (int)buffer_lines.size())
+      j = -1;
+    else if (j >= 0)
+      buffer_to_index[j] = i;
+  }
 }
 
 // Variant of Paul Heckel's diff algorithm to compute |index_to_buffer| and
@@ -246,8 +290,8 @@ void WorkingFile::computeLineMapping() {
 
   // For index line i, set index_to_buffer[i] to -1 if line i is duplicated.
   int i = 0;
-  for (StringRef line : index_lines) {
-    uint64_t h = hashUsr(line);
+  for (std::string_view line : index_lines) {
+    uint64_t h = hashUsr({line.data(), line.size()});
     auto it = hash_to_unique.find(h);
     if (it == hash_to_unique.end()) {
       hash_to_unique[h] = i;
@@ -263,8 +307,8 @@ void WorkingFile::computeLineMapping() {
   // For buffer line i, set buffer_to_index[i] to -1 if line i is duplicated.
   i = 0;
   hash_to_unique.clear();
-  for (StringRef line : buffer_lines) {
-    uint64_t h = hashUsr(line);
+  for (std::string_view line : buffer_lines) {
+    uint64_t h = hashUsr({line.data(), line.size()});
     auto it = hash_to_unique.find(h);
     if (it == hash_to_unique.end()) {
       hash_to_unique[h] = i;
@@ -340,7 +384,7 @@ std::optional<int> WorkingFile::getIndexPosFromBufferPos(int line, int *column,
 }
 
 Position WorkingFile::getCompletionPosition(Position pos, std::string *filter) const {
-  int start = getOffsetForPosition(pos, buffer_content);
+  int start = getOffset(pos);
   int i = start;
 #if LLVM_VERSION_MAJOR < 14 // llvmorg-14-init-3863-g601102d282d5
 #define isAsciiIdentifierContinue isIdentifierBody
@@ -348,7 +392,31 @@ Position WorkingFile::getCompletionPosition(Position pos, std::string *filter) c
   while (i > 0 && isAsciiIdentifierContinue(buffer_content[i - 1]))
     --i;
   *filter = buffer_content.substr(i, start - i);
-  return getPositionForOffset(buffer_content, i);
+  return getPosition(i);
+}
+
+int WorkingFile::getOffset(Position pos) const {
+  if (pos.line >= (int)line_starts.size())
+    return buffer_content.size();
+  size_t i = line_starts[std::max(pos.line, 0)];
+  for (; pos.character > 0 && i < buffer_content.size() &&
+         buffer_content[i] != '\n';
+       pos.character--)
+    if (uint8_t(buffer_content[i++]) >= 128) {
+      // Skip 0b10xxxxxx
+      while (i < buffer_content.size() && uint8_t(buffer_content[i]) >= 128 &&
+             uint8_t(buffer_content[i]) < 192)
+        i++;
+    }
+  return int(i);
+}
+
+Position WorkingFile::getPosition(int offset) const {
+  offset = std::max(std::min(offset, (int)buffer_content.size() - 1), 0);
+  int line =
+      std::upper_bound(line_starts.begin(), line_starts.end(), offset) -
+      line_starts.begin() - 1;
+  return {line, offset - line_starts[line]};
 }
 
 WorkingFile *WorkingFiles::getFile(const std::string &path) {
@@ -406,21 +474,31 @@ void WorkingFiles::onChange(const TextDocumentDidChangeParam &change) {
     // Per the spec replace everything if the rangeLength and range are not set.
     // See https://github.com/Microsoft/language-server-protocol/issues/9.
     if (!diff.range) {
+      // The line mapping will be recomputed from scratch.
       file->buffer_content = diff.text;
       file->onBufferContentUpdated();
     } else {
-      int start_offset =
-          getOffsetForPosition(diff.range->start, file->buffer_content);
+      int start_offset = file->getOffset(diff.range->start);
       // Ignore TextDocumentContentChangeEvent.rangeLength which causes trouble
       // when UTF-16 surrogate pairs are used.
-      int end_offset =
-          getOffsetForPosition(diff.range->end, file->buffer_content);
+      int end_offset = std::max(file->getOffset(diff.range->end), start_offset);
+      auto line_of = [&](int offset) {
+        return int(std::upper_bound(file->line_starts.begin(),
+                                    file->line_starts.end(), offset) -
+                   file->line_starts.begin()) -
+               1;
+      };
+      int first = line_of(start_offset), last = line_of(end_offset);
       file->buffer_content.replace(file->buffer_content.begin() + start_offset,
                                    file->buffer_content.begin() + end_offset,
                                    diff.text);
-      file->onBufferContentUpdated();
+      file->updateLineStarts(start_offset, end_offset, diff.text);
+      file->onLinesReplaced(
+          first, last,
+          1 + std::count(diff.text.begin(), diff.text.end(), '\n'));
     }
   }
+  file->updateBufferLines();
 }
 
 void WorkingFiles::onClose(const std::string &path) {
@@ -434,9 +512,11 @@ void WorkingFiles::onClose(const std::string &path) {
 // This is good enough and fails only for UTF-16 surrogate pairs.
 int getOffsetForPosition(Position pos, std::string_view content) {
   size_t i = 0;
-  for (; pos.line > 0 && i < content.size(); i++)
-    if (content[i] == '\n')
-      pos.line--;
+  for (; pos.line > 0 && i < content.size(); pos.line--) {
+    auto *p = static_cast<const char *>(
+        memchr(content.data() + i, '\n', content.size() - i));
+    i = p ? p - content.data() + 1 : content.size();
+  }
   for (; pos.character > 0 && i < content.size() && content[i] != '\n';
        pos.character--)
     if (uint8_t(content[i++]) >= 128) {
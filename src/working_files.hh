@@ -18,10 +18,17 @@ struct WorkingFile {
   std::string filename;
 
   std::string buffer_content;
+  // The content |index_lines| refers to.
+  std::string index_content;
+  // Views of the lines without line terminators. They are refreshed whenever
+  // the underlying content changes, so no line is copied.
   // Note: This assumes 0-based lines (1-based lines are normally assumed).
-  std::vector<std::string> index_lines;
+  std::vector<std::string_view> index_lines;
   // Note: This assumes 0-based lines (1-based lines are normally assumed).
-  std::vector<std::string> buffer_lines;
+  std::vector<std::string_view> buffer_lines;
+  // Offsets of the start of each line in |buffer_content|. There is one more
+  // entry than the number of newlines.
+  std::vector<int> line_starts;
   // Mappings between index line number and buffer line number.
   // Empty indicates either buffer or index has been changed and re-computation
   // is required.
@@ -36,7 +43,7 @@ struct WorkingFile {
   WorkingFile(const std::string &filename, const std::string &buffer_content);
 
   // This should be called when the indexed content has changed.
-  void setIndexContent(const std::string &index_content);
+  void setIndexContent(const std::string &content);
   // This should be called whenever |buffer_content| has changed.
   void onBufferContentUpdated();
 
@@ -54,6 +61,21 @@ struct WorkingFile {
   // non-alphanumeric character).
   Position getCompletionPosition(Position pos, std::string *filter) const;
 
+  // Like getOffsetForPosition(pos, buffer_content), but uses |line_starts|.
+  int getOffset(Position pos) const;
+  // The inverse of getOffset, except that the column counts bytes.
+  Position getPosition(int offset) const;
+
+  // Updates |line_starts| after [start, end) of |buffer_content| has been
+  // replaced by |text|.
+  void updateLineStarts(int start, int end, std::string_view text);
+  // Updates |index_to_buffer| after buffer lines [first, last] have been
+  // replaced by |count| lines, instead of recomputing the mapping.
+  void onLinesReplaced(int first, int last, int count);
+  // Rebuilds |buffer_lines| from |line_starts| and |buffer_to_index| from
+  // |index_to_buffer|. Call this after a series of the two functions above.
+  void updateBufferLines();
+
 private:
   // Compute index_to_buffer and buffer_to_index.
   void computeLineMapping();